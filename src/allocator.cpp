@@ -1,44 +1,1290 @@
 #include "allocator.hpp"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <unordered_set>
 #include "context.hpp"
+#include "work_stealing_deque.hpp"
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 
 namespace nscheme {
 
+namespace {
 
-void Allocator::gc(Context* ctx)
+
+template <typename F> void visitRoots(Context* ctx, F& f)
+{
+    for (Value& v : ctx->value_stack)
+        f(v);
+    for (Frame*& frame : ctx->frame_stack)
+        f(frame);
+    for (Value& v : ctx->literals)
+        f(v);
+    for (auto& pair : ctx->named_variables)
+        f(pair.second);
+    for (Value* slot : ctx->local_roots)
+        f(*slot);
+}
+
+
+template <typename T> Object* moveTo(Object* obj, void* cell)
 {
-    // std::printf("GC started: size=%zd, limit=%zd\n", size_, limit_);
+    return new (cell) T(std::move(*static_cast<T*>(obj)));
+}
+
+
+Object* moveObject(Object* obj, void* cell)
+{
+    switch (obj->getType()) {
+    case ObjectType::kString:
+        return moveTo<StringObject>(obj, cell);
+    case ObjectType::kReal:
+        return moveTo<RealObject>(obj, cell);
+    case ObjectType::kPair:
+        return moveTo<PairObject>(obj, cell);
+    case ObjectType::kVector:
+        return moveTo<VectorObject>(obj, cell);
+    case ObjectType::kFrame:
+        return moveTo<Frame>(obj, cell);
+    case ObjectType::kClosure:
+        return moveTo<ClosureObject>(obj, cell);
+    case ObjectType::kCFunction:
+        return moveTo<CFunctionObject>(obj, cell);
+    case ObjectType::kContinuation:
+        return moveTo<ContinuationObject>(obj, cell);
+    case ObjectType::kWeakBox:
+        return moveTo<WeakBoxObject>(obj, cell);
+    case ObjectType::kEphemeron:
+        return moveTo<EphemeronObject>(obj, cell);
+    case ObjectType::kWeakTable:
+        return moveTo<WeakTableObject>(obj, cell);
+    case ObjectType::kGuardian:
+        return moveTo<GuardianObject>(obj, cell);
+    case ObjectType::kForwarded:
+        break;
+    }
+    throw std::logic_error("moveObject: unexpected object type");
+}
 
-    for (Object* obj : objects_)
-        obj->resetMark();
 
-    for (Value v : ctx->value_stack) {
+// obj が移動済みなら移動先を、そうでなければ nullptr を返す
+Object* forwardingAddressOf(Object* obj)
+{
+    Page* page = Page::of(obj);
+    if (page->holdsPairs())
+        return page->getForwardingAddress(obj);
+    if (obj->getType() == ObjectType::kForwarded)
+        return static_cast<ForwardedObject*>(obj)->getDestination();
+    return nullptr;
+}
+
+
+// 移動し終えた obj を破棄し、跡地に移動先を残す
+void leaveForwardingAddress(Object* obj, Object* destination)
+{
+    size_t size = obj->size();
+    obj->destroy();
+    Page* page = Page::of(obj);
+    if (page->holdsPairs())
+        page->setForwardingAddress(obj, destination);
+    else
+        new (obj) ForwardedObject(destination, size);
+}
+
+
+bool holdsWeakReferences(Object* obj)
+{
+    switch (obj->getType()) {
+    case ObjectType::kWeakBox:
+    case ObjectType::kEphemeron:
+    case ObjectType::kWeakTable:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+// 若い世代の回収の後で obj が生き残っていればその場所を、死んでいれば nullptr を返す
+Object* survivorOf(Object* obj)
+{
+    if (!Page::of(obj)->isYoung())
+        return obj;
+    return forwardingAddressOf(obj);
+}
+
+
+// 古い世代のマークの後で v が生きているかどうか。若い世代と不死のものは生きているとみなす
+bool isMarkedOrYoung(Value v)
+{
+    if (!v.isPointer())
+        return true;
+    Page* page = Page::of(v.asPointer());
+    return !page->isOld() || page->isMarked(v.asPointer());
+}
+
+
+// リージョンのオブジェクトへの参照があれば found を立てる
+struct RegionFinder {
+    bool found = false;
+
+    void operator()(Value& v)
+    {
+        if (v.isPointer() && Page::of(v.asPointer())->isRegion())
+            found = true;
+    }
+
+    void operator()(Frame*& frame)
+    {
+        if (frame != nullptr && Page::of(frame)->isRegion())
+            found = true;
+    }
+};
+
+
+// 並列マークの各スレッドの作業場。
+// 自分の deque が空になったら他のスレッドの deque から盗み、全員が暇になったら終わる。
+struct MarkWorker {
+    MarkWorker* workers = nullptr;
+    size_t n_workers = 0;
+    size_t id = 0;
+    std::atomic<size_t>* n_active = nullptr;
+    WorkStealingDeque<Object> deque;
+    std::vector<Object*> overflow;
+    size_t marked_objects = 0;
+    size_t marked_bytes = 0;
+
+    void operator()(Value& slot)
+    {
+        Value v = Value::load(slot);
         if (v.isPointer())
-            v.asPointer()->mark();
+            push(v.asPointer());
     }
-    for (Frame* f : ctx->frame_stack) {
-        f->mark();
+
+    void operator()(Frame*& slot)
+    {
+        Frame* frame = __atomic_load_n(&slot, __ATOMIC_ACQUIRE);
+        if (frame != nullptr)
+            push(frame);
     }
-    for (Value v : ctx->literals) {
+
+    void push(Object* obj)
+    {
+        if (!Page::of(obj)->isOld())
+            return;
+        __builtin_prefetch(obj, 1);
+        if (!deque.push(obj))
+            overflow.push_back(obj);
+    }
+
+    Object* pop()
+    {
+        if (Object* obj = deque.pop())
+            return obj;
+        // 溢れていた分を deque に戻して、他のスレッドからも盗めるようにする
+        while (!overflow.empty() && deque.push(overflow.back()))
+            overflow.pop_back();
+        return deque.pop();
+    }
+
+    Object* steal()
+    {
+        for (size_t i = 1; i < n_workers; ++i) {
+            if (Object* obj = workers[(id + i) % n_workers].deque.steal())
+                return obj;
+        }
+        return nullptr;
+    }
+
+    // 他のスレッドに仕事が残っていれば true、全員の仕事が尽きていれば false を返す
+    bool waitForWork()
+    {
+        n_active->fetch_sub(1);
+        for (;;) {
+            if (n_active->load() == 0)
+                return false;
+            for (size_t i = 1; i < n_workers; ++i) {
+                if (!workers[(id + i) % n_workers].deque.isEmpty()) {
+                    n_active->fetch_add(1);
+                    return true;
+                }
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    void run()
+    {
+        for (;;) {
+            Object* obj = pop();
+            if (obj == nullptr)
+                obj = steal();
+            if (obj == nullptr) {
+                if (waitForWork())
+                    continue;
+                return;
+            }
+            if (Page::of(obj)->tryMark(obj)) {
+                marked_objects++;
+                marked_bytes += obj->getTotalSize();
+                visitReferences(obj, *this);
+            }
+        }
+    }
+};
+
+
+} // namespace
+
+
+constexpr size_t Allocator::kMaxThreads;
+constexpr size_t Allocator::kPairClass;
+constexpr double Allocator::kMinGrowth;
+constexpr double Allocator::kMaxGrowth;
+
+
+struct Allocator::Evacuator {
+    Allocator* allocator;
+
+    void operator()(Value& v)
+    {
         if (v.isPointer())
-            v.asPointer()->mark();
+            Value::store(v, Value::fromPointer(allocator->evacuate(v.asPointer())));
+    }
+
+    void operator()(Frame*& frame)
+    {
+        if (frame != nullptr)
+            __atomic_store_n(&frame, static_cast<Frame*>(allocator->evacuate(frame)),
+                             __ATOMIC_RELEASE);
+    }
+};
+
+
+// 参照先をマークスタックに積む。
+// 参照先のメモリに触れずに済むよう、マーク済みかどうかは取り出す時に調べる。
+// インタプリタと並行に動くこともあるので、参照は Value::load() などで読む。
+struct Allocator::Marker {
+    Allocator* allocator;
+
+    void operator()(Value& slot)
+    {
+        Value v = Value::load(slot);
+        if (v.isPointer())
+            allocator->shade(v.asPointer());
+    }
+
+    void operator()(Frame*& slot)
+    {
+        Frame* frame = __atomic_load_n(&slot, __ATOMIC_ACQUIRE);
+        if (frame != nullptr)
+            allocator->shade(frame);
+    }
+};
+
+
+// 移動したオブジェクトへの参照を移動先に付け替える
+struct Allocator::Forwarder {
+    static Object* forward(Object* obj)
+    {
+        Object* destination = forwardingAddressOf(obj);
+        return destination != nullptr ? destination : obj;
+    }
+
+    void operator()(Value& v)
+    {
+        if (v.isPointer())
+            v = Value::fromPointer(forward(v.asPointer()));
+    }
+
+    void operator()(Frame*& frame)
+    {
+        if (frame != nullptr)
+            frame = static_cast<Frame*>(forward(frame));
+    }
+};
+
+
+// リージョンのオブジェクトを古い世代に移す。移したものは promoted_ に積む
+struct Allocator::Promoter {
+    Allocator* allocator;
+
+    Object* promote(Object* obj)
+    {
+        if (!Page::of(obj)->isRegion())
+            return obj;
+        if (Object* destination = forwardingAddressOf(obj))
+            return destination;
+
+        Object* moved = moveObject(obj, allocator->allocateOld(obj->size(), obj->getType()));
+        allocator->commitOld(moved);
+        leaveForwardingAddress(obj, moved);
+        allocator->promoted_.push_back(moved);
+        return moved;
+    }
+
+    void operator()(Value& v)
+    {
+        if (v.isPointer())
+            v = Value::fromPointer(promote(v.asPointer()));
+    }
+
+    void operator()(Frame*& frame)
+    {
+        if (frame != nullptr)
+            frame = static_cast<Frame*>(promote(frame));
     }
+};
 
-    auto pred = [this](const Object* obj) {
-        if (!obj->isMarked()) {
-            // std::printf("  GC collect: size=%zd\n", obj->size());
-            size_ -= obj->size();
-            delete obj;
+
+Allocator::Allocator()
+{
+    static_assert(sizeof(PairObject) == Page::kCellAlign, "PairObject must fill a cell exactly");
+
+    for (size_t i = 0; i < kNurseryPages; ++i) {
+        nursery_.pages.push_back(Page::createYoung(&page_space_, this, false));
+        pair_nursery_.pages.push_back(Page::createYoung(&page_space_, this, true));
+    }
+}
+
+
+Allocator::~Allocator()
+{
+    if (marker_thread_.joinable())
+        stopMarkerThread();
+    for (Page* page : nursery_.pages)
+        Page::destroy(page);
+    for (Page* page : pair_nursery_.pages)
+        Page::destroy(page);
+    for (Page* page : immortal_pages_)
+        Page::destroy(page);
+    for (Page* page : immortal_pair_pages_)
+        Page::destroy(page);
+    // リージョンのオブジェクトは dropRegion() で破棄し終えている
+    if (in_region_)
+        dropRegion();
+    for (Nursery* region : {&region_, &region_pairs_}) {
+        for (Page* page : region->pages) {
+            page->resetYoung();
+            Page::destroy(page);
+        }
+    }
+    for (SizeClass& size_class : size_classes_) {
+        for (Page* page : size_class.pages)
+            Page::destroy(page);
+    }
+    for (Page* page : large_pages_)
+        Page::destroy(page);
+}
+
+
+void Allocator::notifyGrowth(Object* obj, size_t bytes)
+{
+    Page* page = Page::of(obj);
+    Allocator* allocator = page->getOwner();
+    if (page->isImmortal())
+        return;
+    if (page->isYoung()) {
+        allocator->young_external_size_ += bytes;
+        return;
+    }
+    allocator->size_ += bytes;
+    if (allocator->marking_ && page->isMarked(obj))
+        allocator->marked_bytes_ += bytes;
+}
+
+
+void Allocator::remember(Object* obj)
+{
+    Page* page = Page::of(obj);
+    if (page->isRemembered(obj))
+        return;
+    page->setRemembered(obj, true);
+    if (page->isImmortal())
+        immortal_remembered_.push_back(obj);
+    else
+        remembered_.push_back(obj);
+}
+
+
+bool Allocator::advanceNursery(Nursery& nursery)
+{
+    if (nursery.index + 1 < nursery.pages.size()) {
+        nursery.index++;
+        return true;
+    }
+    nursery_full_ = true;
+    return false;
+}
+
+
+void* Allocator::allocateOld(size_t size, ObjectType type)
+{
+    if (size > kMaxSmallSize)
+        return allocateLarge(size);
+
+    bool pairs = type == ObjectType::kPair;
+    size_t index = pairs ? kPairClass : (size + Page::kCellAlign - 1) / Page::kCellAlign - 1;
+    SizeClass& size_class = size_classes_[index];
+    for (;;) {
+        if (size_class.current != nullptr) {
+            if (void* cell = size_class.current->allocate())
+                return cell;
+        }
+        if (!size_class.available.empty()) {
+            size_class.current = size_class.available.back();
+            size_class.available.pop_back();
+            continue;
+        }
+        if (size_class.unswept.empty())
+            break;
+        // 前回のマークの後まだ sweep していないページを、必要になった分だけ sweep する
+        size_class.current = size_class.unswept.back();
+        size_class.unswept.pop_back();
+        size_t n_live = size_class.current->getLiveCount();
+        freed_bytes_ += size_class.current->sweep(reclaimer_.get());
+        freed_objects_ += n_live - size_class.current->getLiveCount();
+    }
+
+    size_t cell_size = pairs ? Page::kCellAlign : (index + 1) * Page::kCellAlign;
+    Page* page = Page::create(&page_space_, this, cell_size, pairs);
+    size_class.pages.push_back(page);
+    size_class.current = page;
+    return page->allocate();
+}
+
+
+void* Allocator::allocateLarge(size_t size)
+{
+    Page* page = Page::create(&page_space_, this, size, false);
+    large_pages_.push_back(page);
+    return page->allocate();
+}
+
+
+void* Allocator::allocateImmortal(std::vector<Page*>& pages, size_t size, bool pairs)
+{
+    if (!pages.empty()) {
+        if (void* cell = pages.back()->allocateYoung(size))
+            return cell;
+    }
+    pages.push_back(Page::createImmortal(&page_space_, this, pairs));
+    return pages.back()->allocateYoung(size);
+}
+
+
+// リージョンのページは若い世代と同じく先頭から使い、使い終えたページは次のリージョンで使い回す
+void* Allocator::allocateInRegion(Nursery& region, size_t size, bool pairs)
+{
+    if (!region.pages.empty()) {
+        if (void* cell = region.pages[region.index]->allocateYoung(size))
+            return cell;
+    }
+    if (region.index + 1 < region.pages.size()) {
+        Page* page = region.pages[++region.index];
+        page->resetYoung();
+        return page->allocateYoung(size);
+    }
+    region.pages.push_back(Page::createRegion(&page_space_, this, pairs));
+    region.index = region.pages.size() - 1;
+    return region.pages.back()->allocateYoung(size);
+}
+
+
+void Allocator::beginRegion()
+{
+    // リージョンの中では GC をしないので、途中の古い世代のマークはここで終わらせる
+    if (marking_) {
+        completeMarking();
+        releaseMemory();
+        updateLimit(Clock::now());
+    }
+    in_region_ = true;
+}
+
+
+void Allocator::endRegion(Context* ctx)
+{
+    RegionFinder finder;
+    visitRoots(ctx, finder);
+    if (finder.found)
+        throw std::runtime_error("a root still refers to an object in the region");
+    dropRegion();
+}
+
+
+// 移したオブジェクトの跡地は転送済みになっているので、破棄しない
+void Allocator::dropRegion()
+{
+    for (Object* obj : region_owners_) {
+        if (forwardingAddressOf(obj) == nullptr)
+            obj->destroy(reclaimer_.get());
+    }
+    region_owners_.clear();
+    for (Nursery* region : {&region_, &region_pairs_}) {
+        region->index = 0;
+        if (!region->pages.empty())
+            region->pages[0]->resetYoung();
+    }
+    in_region_ = false;
+}
+
+
+// 移したものは古い世代から若い世代を指しているかもしれないので記憶しておく
+Value Allocator::promote(Value v)
+{
+    Promoter promoter{this};
+    promoter(v);
+    while (!promoted_.empty()) {
+        Object* obj = promoted_.back();
+        promoted_.pop_back();
+        visitReferences(obj, promoter);
+        remember(obj);
+        switch (obj->getType()) {
+        case ObjectType::kWeakBox:
+        case ObjectType::kEphemeron:
+        case ObjectType::kWeakTable:
+            weak_objects_.push_back(obj);
+            break;
+        case ObjectType::kGuardian:
+            guardians_.push_back(static_cast<GuardianObject*>(obj));
+            break;
+        default:
+            break;
+        }
+    }
+    return v;
+}
+
+
+Object* Allocator::evacuate(Object* obj)
+{
+    static_assert(sizeof(ForwardedObject) <= sizeof(RealObject),
+                  "ForwardedObject must fit in the smallest object");
+
+    Page* page = Page::of(obj);
+    if (!page->isYoung())
+        return obj;
+    if (Object* destination = forwardingAddressOf(obj))
+        return destination;
+    if (!page->holdsPairs())
+        return copyToOld(obj);
+
+    // リストの後ろのセルを先に続けてコピーして、古い世代のページで隣り合うように並べる。
+    // car の指すものは後で promoted_ から辿る
+    Object* moved = copyToOld(obj);
+    for (Value cdr = static_cast<PairObject*>(moved)->getCdr(); cdr.isPointer();) {
+        Object* next = cdr.asPointer();
+        Page* next_page = Page::of(next);
+        if (!next_page->isYoung() || !next_page->holdsPairs()
+            || next_page->getForwardingAddress(next) != nullptr)
+            break;
+        cdr = static_cast<PairObject*>(copyToOld(next))->getCdr();
+    }
+    return moved;
+}
+
+
+// 跡地に移動先を残し、コピーしたものは参照を辿るために promoted_ に積む
+Object* Allocator::copyToOld(Object* obj)
+{
+    Object* moved = moveObject(obj, allocateOld(obj->size(), obj->getType()));
+    promoted_bytes_ += commitOld(moved);
+    leaveForwardingAddress(obj, moved);
+    promoted_.push_back(moved);
+    return moved;
+}
+
+
+void Allocator::collectYoung(Context* ctx)
+{
+    Evacuator evacuator{this};
+    visitRoots(ctx, evacuator);
+    // 弱い参照を持つ古いオブジェクトのうち、若いオブジェクトを指しうるのは記憶集合にあるものだけ
+    for (Object* obj : remembered_) {
+        Page::of(obj)->setRemembered(obj, false);
+        if (holdsWeakReferences(obj))
+            dirty_weak_objects_.push_back(obj);
+        visitReferences(obj, evacuator);
+    }
+    remembered_.clear();
+    visitImmortalReferences(evacuator);
+
+    // コピーしたオブジェクトが指している若いオブジェクトを順にコピーする。
+    // キーが生き残った ephemeron の値もコピーし、コピーするものがなくなったら
+    // guardian に登録された死んだオブジェクトを復活させて繰り返す。
+    do {
+        while (!promoted_.empty()) {
+            Object* obj = promoted_.back();
+            promoted_.pop_back();
+            visitReferences(obj, evacuator);
+        }
+    } while (evacuateEphemeronValues() || rescueYoungGuarded());
+    clearYoungWeakReferences();
+
+    // 残っているのは死んだオブジェクトと転送済みの跡地だけ
+    if (stats_ != nullptr) {
+        auto count = [this](Object* obj) {
+            if (forwardingAddressOf(obj) == nullptr) {
+                freed_objects_++;
+                freed_bytes_ += obj->getTotalSize();
+            }
+        };
+        for (Nursery* nursery : {&nursery_, &pair_nursery_}) {
+            for (size_t i = 0; i <= nursery->index; ++i)
+                nursery->pages[i]->forEachObject(count);
+        }
+    }
+    for (Nursery* nursery : {&nursery_, &pair_nursery_}) {
+        for (size_t i = 0; i <= nursery->index; ++i)
+            nursery->pages[i]->clear(reclaimer_.get());
+        nursery->index = 0;
+    }
+    nursery_full_ = false;
+    young_external_size_ = 0;
+}
+
+
+// 新しくコピーしたものがあれば true を返す
+bool Allocator::evacuateEphemeronValues()
+{
+    Evacuator evacuator{this};
+    bool evacuated = false;
+    auto evacuate_value = [&evacuator, &evacuated](Value& key, Value& value) {
+        if ((!key.isPointer() || survivorOf(key.asPointer()) != nullptr) && value.isPointer()
+            && survivorOf(value.asPointer()) == nullptr) {
+            evacuator(value);
+            evacuated = true;
+        }
+        return true;
+    };
+    for (Object* obj : young_weak_objects_) {
+        if (Object* weak = survivorOf(obj))
+            updateEntries(weak, evacuate_value);
+    }
+    for (Object* obj : dirty_weak_objects_)
+        updateEntries(obj, evacuate_value);
+    return evacuated;
+}
+
+
+// guardian に登録された死んだ若いオブジェクトをコピーして取り出し待ちにする。
+// コピーしたものがあれば true を返す
+bool Allocator::rescueYoungGuarded()
+{
+    Evacuator evacuator{this};
+    bool rescued = false;
+    auto rescue = [&evacuator, &rescued](Value& obj) {
+        if (!obj.isPointer())
+            return true;
+        if (Object* survivor = survivorOf(obj.asPointer())) {
+            obj = Value::fromPointer(survivor);
             return true;
         }
+        evacuator(obj);
+        rescued = true;
+        return false;
+    };
+    for (GuardianObject* guardian : guardians_) {
+        if (Object* survivor = survivorOf(guardian))
+            static_cast<GuardianObject*>(survivor)->updateRegistered(rescue);
+    }
+    return rescued;
+}
+
+
+// 死んだ若いオブジェクトへの弱い参照を消し、生き残ったものへの参照を移動先に付け替える。
+// 若いオブジェクトを指しうる、若い世代のものと記憶集合にあったものだけを調べる
+void Allocator::clearYoungWeakReferences()
+{
+    auto forward = [](Value& key, Value& value) {
+        if (key.isPointer()) {
+            Object* survivor = survivorOf(key.asPointer());
+            if (survivor == nullptr)
+                return false;
+            key = Value::fromPointer(survivor);
+        }
+        // キーが生きていれば値もコピー済み
+        if (value.isPointer())
+            value = Value::fromPointer(survivorOf(value.asPointer()));
+        return true;
+    };
+    for (Object* obj : young_weak_objects_) {
+        if (Object* weak = survivorOf(obj)) {
+            updateEntries(weak, forward);
+            weak_objects_.push_back(weak);
+        }
+    }
+    young_weak_objects_.clear();
+    for (Object* obj : dirty_weak_objects_)
+        updateEntries(obj, forward);
+    dirty_weak_objects_.clear();
+
+    auto guardian_it = guardians_.begin();
+    for (GuardianObject* guardian : guardians_) {
+        if (Object* survivor = survivorOf(guardian))
+            *guardian_it++ = static_cast<GuardianObject*>(survivor);
+    }
+    guardians_.erase(guardian_it, guardians_.end());
+}
+
+
+void Allocator::startMarking(Context* ctx)
+{
+    // sweep がマークビットを消すので、すべてのページを sweep し終えればマークは白に戻っている
+    finishSweeping();
+
+    // 直前に若い世代を回収しているので、ここで灰色にしたものがスナップショットのすべて。
+    // 以降に割り当てたものは黒、書き換えで消える参照は書き込みバリアが灰色にする。
+    marking_ = true;
+    marking_start_size_ = size_;
+    marked_objects_ = 0;
+    marked_bytes_ = 0;
+    Marker marker{this};
+    visitRoots(ctx, marker);
+    visitImmortalReferences(marker);
+}
+
+
+bool Allocator::drainMarkStack(Clock::time_point deadline)
+{
+    if (n_threads_ > 1 && deadline == Clock::time_point::max()) {
+        markInParallel();
+        return true;
+    }
+
+    // スタックから取り出したオブジェクトはプリフェッチしてから小さな FIFO で寝かせ、
+    // 後続のオブジェクトを処理している間にキャッシュに載るようにする
+    Marker marker{this};
+    Object* queue[kPrefetchDistance];
+    size_t head = 0;
+    size_t n_queued = 0;
+    size_t marked_objects = 0;
+    size_t marked_bytes = 0;
+    for (size_t n_processed = 1;; ++n_processed) {
+        while (n_queued < kPrefetchDistance && !mark_stack_.empty()) {
+            Object* obj = mark_stack_.back();
+            mark_stack_.pop_back();
+            __builtin_prefetch(obj, 1);
+            queue[(head + n_queued) % kPrefetchDistance] = obj;
+            n_queued++;
+        }
+        if (n_queued == 0) {
+            marked_objects_ += marked_objects;
+            marked_bytes_ += marked_bytes;
+            return true;
+        }
+
+        if (n_processed % kClockCheckInterval == 0 && Clock::now() >= deadline) {
+            for (; n_queued > 0; --n_queued)
+                mark_stack_.push_back(queue[(head + n_queued - 1) % kPrefetchDistance]);
+            marked_objects_ += marked_objects;
+            marked_bytes_ += marked_bytes;
+            return false;
+        }
+
+        Object* obj = queue[head];
+        head = (head + 1) % kPrefetchDistance;
+        n_queued--;
+        if (!Page::of(obj)->tryMark(obj))
+            continue;
+        marked_objects++;
+        marked_bytes += obj->getTotalSize();
+        visitReferences(obj, marker);
+    }
+}
+
+
+void Allocator::markInParallel()
+{
+    std::unique_ptr<MarkWorker[]> workers(new MarkWorker[n_threads_]);
+    std::atomic<size_t> n_active(n_threads_);
+    for (size_t i = 0; i < n_threads_; ++i) {
+        workers[i].workers = workers.get();
+        workers[i].n_workers = n_threads_;
+        workers[i].id = i;
+        workers[i].n_active = &n_active;
+    }
+    for (size_t i = 0; i < mark_stack_.size(); ++i)
+        workers[i % n_threads_].push(mark_stack_[i]);
+    mark_stack_.clear();
+
+    workers_.run(n_threads_, [&workers](size_t id) { workers[id].run(); });
+    for (size_t i = 0; i < n_threads_; ++i) {
+        marked_objects_ += workers[i].marked_objects;
+        marked_bytes_ += workers[i].marked_bytes;
+    }
+}
+
+
+void Allocator::startMarkerThread()
+{
+    marker_idle_ = false;
+    marker_stop_ = false;
+    marker_thread_ = std::thread(&Allocator::runMarker, this);
+}
+
+
+// 溜まった記録をマークスレッドに渡す。
+// マークスレッドが渡された仕事を終えていれば、記録は渡さずに true を返す
+bool Allocator::handOverToMarker()
+{
+    std::lock_guard<std::mutex> lock(marker_mutex_);
+    // 書き換えが続く限り記録は溜まり続けるので、それを待たずに最後の停止でまとめて処理する
+    if (marker_idle_ && satb_queue_.empty())
+        return true;
+    if (!satb_buffer_.empty()) {
+        satb_queue_.insert(satb_queue_.end(), satb_buffer_.begin(), satb_buffer_.end());
+        satb_buffer_.clear();
+        marker_cond_.notify_one();
+    }
+    return false;
+}
+
+
+void Allocator::stopMarkerThread()
+{
+    {
+        std::lock_guard<std::mutex> lock(marker_mutex_);
+        marker_stop_ = true;
+        marker_cond_.notify_one();
+    }
+    marker_thread_.join();
+    mark_stack_.insert(mark_stack_.end(), satb_queue_.begin(), satb_queue_.end());
+    satb_queue_.clear();
+}
+
+
+void Allocator::runMarker()
+{
+    std::unique_lock<std::mutex> lock(marker_mutex_);
+    for (;;) {
+        mark_stack_.insert(mark_stack_.end(), satb_queue_.begin(), satb_queue_.end());
+        satb_queue_.clear();
+        if (mark_stack_.empty()) {
+            if (marker_stop_)
+                return;
+            marker_idle_ = true;
+            marker_cond_.wait(lock, [this] { return marker_stop_ || !satb_queue_.empty(); });
+            marker_idle_ = false;
+            continue;
+        }
+        lock.unlock();
+        drainMarkStack(Clock::time_point::max());
+        lock.lock();
+    }
+}
+
+
+// キーがマークされた ephemeron の値と guardian の取り出し待ちのオブジェクトをマークする。
+// 新しくマークするものがなくなったら、guardian に登録されたマークされていないオブジェクトを
+// 取り出し待ちに移してマークし、それもなくなるまで繰り返す。
+void Allocator::markWeakReachable()
+{
+    auto shade_value = [this](Value& key, Value& value) {
+        if (isMarkedOrYoung(key) && !isMarkedOrYoung(value))
+            mark_stack_.push_back(value.asPointer());
+        return true;
+    };
+    auto shade_ready = [this](Value& obj) {
+        if (!isMarkedOrYoung(obj))
+            mark_stack_.push_back(obj.asPointer());
+    };
+    auto rescue = [this](Value& obj) {
+        if (isMarkedOrYoung(obj))
+            return true;
+        mark_stack_.push_back(obj.asPointer());
         return false;
     };
-    objects_.remove_if(pred);
+    for (;;) {
+        for (Object* obj : weak_objects_) {
+            if (isMarkedOrYoung(Value::fromPointer(obj)))
+                updateEntries(obj, shade_value);
+        }
+        for (GuardianObject* guardian : guardians_) {
+            if (isMarkedOrYoung(Value::fromPointer(guardian)))
+                guardian->visitReady(shade_ready);
+        }
+        if (mark_stack_.empty()) {
+            for (GuardianObject* guardian : guardians_) {
+                if (isMarkedOrYoung(Value::fromPointer(guardian)))
+                    guardian->updateRegistered(rescue);
+            }
+            if (mark_stack_.empty())
+                return;
+        }
+        drainMarkStack(Clock::time_point::max());
+    }
+}
+
 
-    while (size_ > limit_)
-        limit_ *= 2;
+// 死んだオブジェクトの回収は割り当て時にページ単位で行うので、ここでは大きなページだけを回収する。
+// 生きているオブジェクトの大きさはマークの間に数えてある。
+void Allocator::finishMarking()
+{
+    markWeakReachable();
+    marking_ = false;
+    size_ = marked_bytes_;
+
+    // 死んだキーの項目と、回収されるオブジェクトへの弱い参照を消す
+    auto live_key = [](Value& key, Value&) { return isMarkedOrYoung(key); };
+    auto weak_it = weak_objects_.begin();
+    for (Object* obj : weak_objects_) {
+        if (!isMarkedOrYoung(Value::fromPointer(obj)))
+            continue;
+        updateEntries(obj, live_key);
+        *weak_it++ = obj;
+    }
+    weak_objects_.erase(weak_it, weak_objects_.end());
+    guardians_.erase(std::remove_if(guardians_.begin(), guardians_.end(),
+                                    [](GuardianObject* guardian) {
+                                        return !isMarkedOrYoung(Value::fromPointer(guardian));
+                                    }),
+                     guardians_.end());
+
+    // 一つもマークされていないペアのページは、壊すものがないので sweep を待たずにすぐ返す。
+    // それ以外のページはデストラクタを呼ぶ必要があるので、停止を延ばさないよう sweep に任せる
+    for (SizeClass& size_class : size_classes_) {
+        std::vector<Page*>& pages = size_class.pages;
+        pages.erase(std::remove_if(pages.begin(), pages.end(),
+                                   [this](Page* page) {
+                                       return page->holdsPairs() && releaseIfUnmarked(page);
+                                   }),
+                    pages.end());
+        size_class.unswept = pages;
+        size_class.available.clear();
+        size_class.current = nullptr;
+    }
 
-    // std::printf("GC end: size=%zd, limit=%zd\n", size_, limit_);
+    auto it = large_pages_.begin();
+    for (Page* page : large_pages_) {
+        if (releaseIfUnmarked(page))
+            continue;
+        page->sweep();
+        *it++ = page;
+    }
+    large_pages_.erase(it, large_pages_.end());
+}
+
+
+// マークの後で page に生きているオブジェクトがなければ、page を返して true を返す
+bool Allocator::releaseIfUnmarked(Page* page)
+{
+    if (page->countMarked() != 0)
+        return false;
+    if (stats_ != nullptr) {
+        page->forEachObject([this](Object* obj) {
+            freed_objects_++;
+            freed_bytes_ += obj->getTotalSize();
+        });
+    }
+    releasePage(page);
+    return true;
+}
+
+
+// 古い世代を回収した後、空いたページの物理メモリを OS に返す。
+// 生き残りが大きく減っていれば、malloc が抱えている配列などの空き領域も返させる。
+void Allocator::releaseMemory()
+{
+    page_space_.trim();
+#ifdef __GLIBC__
+    if (size_ < marking_start_size_ / 2)
+        malloc_trim(0);
+#endif
+}
+
+
+// 古い世代を回収し終えたら、生き残った大きさから次の回収を始める大きさを決める
+void Allocator::updateLimit(Clock::time_point now)
+{
+    if (target_gc_fraction_ > 0) {
+        // 生き残りが同じなら GC 一回の時間は変わらず、回収の間隔は余裕の大きさに比例する。
+        // 実測した GC の時間の割合と目標との比で余裕を伸び縮みさせる。
+        double elapsed = std::chrono::duration<double>(now - period_start_).count();
+        double gc_time = std::chrono::duration<double>(gc_time_).count();
+        if (elapsed > 0) {
+            double headroom = (growth_ - 1) * (gc_time / elapsed) / target_gc_fraction_;
+            growth_ = std::min(std::max(1 + headroom, kMinGrowth), kMaxGrowth);
+        }
+    }
+    limit_ = std::max(initial_limit_, static_cast<size_t>(size_ * growth_));
+    gc_time_ = Clock::duration::zero();
+    period_start_ = now;
+}
+
+
+// 割り当てで sweep されずに残っているページをすべて sweep する
+void Allocator::finishSweeping()
+{
+    std::vector<Page*> pages;
+    for (SizeClass& size_class : size_classes_)
+        pages.insert(pages.end(), size_class.unswept.begin(), size_class.unswept.end());
+    if (pages.empty())
+        return;
+
+    // ページ毎に独立しているので、ページ単位で分担する
+    std::atomic<size_t> next(0);
+    std::atomic<size_t> freed_objects(0);
+    std::atomic<size_t> freed_bytes(0);
+    workers_.run(std::min(n_threads_, pages.size()), [&](size_t) {
+        for (size_t i; (i = next.fetch_add(1)) < pages.size();) {
+            size_t n_live = pages[i]->getLiveCount();
+            freed_bytes += pages[i]->sweep(reclaimer_.get());
+            freed_objects += n_live - pages[i]->getLiveCount();
+        }
+    });
+    freed_objects_ += freed_objects;
+    freed_bytes_ += freed_bytes;
+
+    for (SizeClass& size_class : size_classes_) {
+        if (size_class.unswept.empty())
+            continue;
+        size_class.unswept.clear();
+        size_class.available.clear();
+
+        auto it = size_class.pages.begin();
+        for (Page* page : size_class.pages) {
+            if (page->getLiveCount() == 0 && page != size_class.current) {
+                releasePage(page);
+                continue;
+            }
+            if (!page->isFull() && page != size_class.current)
+                size_class.available.push_back(page);
+            *it++ = page;
+        }
+        size_class.pages.erase(it, size_class.pages.end());
+    }
+}
+
+
+void Allocator::releasePage(Page* page)
+{
+    if (reclaimer_)
+        reclaimer_->destroyLater(page);
+    else
+        Page::destroy(page);
+}
+
+
+// sweep で空になって返されるページを除き、ページ中の空きセルの割合を返す。
+// マークの直後、まだどのページも sweep していない時に呼ぶ。
+double Allocator::fragmentation() const
+{
+    size_t n_cells = 0;
+    size_t n_marked = 0;
+    for (const SizeClass& size_class : size_classes_) {
+        for (Page* page : size_class.pages) {
+            size_t n = page->countMarked();
+            if (n == 0)
+                continue;
+            n_cells += page->getCapacity();
+            n_marked += n;
+        }
+    }
+    return n_cells == 0 ? 0 : 1 - double(n_marked) / n_cells;
+}
+
+
+// サイズクラス毎に、生きているオブジェクトが収まるだけのページを密なものから選んで残し、
+// 残りのページのオブジェクトをそこへ移す。
+// 命令列から直接指されているリテラルは動かせないので、それを含むページは必ず残す。
+void Allocator::evacuateSparsePages(Context* ctx)
+{
+    finishSweeping();
+
+    std::unordered_set<Page*> pinned;
+    for (Value v : ctx->literals) {
+        if (v.isPointer())
+            pinned.insert(Page::of(v.asPointer()));
+    }
+
+    std::vector<Page*> sources;
+    for (SizeClass& size_class : size_classes_) {
+        std::vector<Page*>& pages = size_class.pages;
+        std::sort(pages.begin(), pages.end(), [&pinned](Page* a, Page* b) {
+            bool a_pinned = pinned.count(a) != 0;
+            bool b_pinned = pinned.count(b) != 0;
+            if (a_pinned != b_pinned)
+                return a_pinned;
+            return a->getLiveCount() > b->getLiveCount();
+        });
+
+        size_t n_live = 0;
+        for (Page* page : pages)
+            n_live += page->getLiveCount();
+        size_t n_kept = 0;
+        for (size_t capacity = 0; n_kept < pages.size(); ++n_kept) {
+            if (capacity >= n_live && pinned.count(pages[n_kept]) == 0)
+                break;
+            capacity += pages[n_kept]->getCapacity();
+        }
+        if (n_kept == pages.size())
+            continue;
+
+        size_t destination = 0;
+        for (size_t i = n_kept; i < pages.size(); ++i) {
+            pages[i]->forEachObject([&](Object* obj) {
+                void* cell;
+                while ((cell = pages[destination]->allocate()) == nullptr)
+                    destination++;
+                Object* moved = moveObject(obj, cell);
+                pages[destination]->commit(moved);
+                leaveForwardingAddress(obj, moved);
+            });
+            sources.push_back(pages[i]);
+        }
+        pages.resize(n_kept);
+
+        size_class.available.clear();
+        size_class.current = nullptr;
+        for (Page* page : pages) {
+            if (!page->isFull())
+                size_class.available.push_back(page);
+        }
+    }
+    if (sources.empty())
+        return;
+
+    Forwarder forwarder;
+    visitRoots(ctx, forwarder);
+    visitImmortalReferences(forwarder);
+    auto forward = [&forwarder](Object* obj) { visitReferences(obj, forwarder); };
+    for (SizeClass& size_class : size_classes_) {
+        for (Page* page : size_class.pages)
+            page->forEachObject(forward);
+    }
+    for (Page* page : large_pages_)
+        page->forEachObject(forward);
+    auto forward_entry = [&forwarder](Value& key, Value& value) {
+        forwarder(key);
+        forwarder(value);
+        return true;
+    };
+    for (Object*& obj : weak_objects_) {
+        obj = Forwarder::forward(obj);
+        updateEntries(obj, forward_entry);
+    }
+    auto forward_registered = [&forwarder](Value& obj) {
+        forwarder(obj);
+        return true;
+    };
+    for (GuardianObject*& guardian : guardians_) {
+        guardian = static_cast<GuardianObject*>(Forwarder::forward(guardian));
+        guardian->updateRegistered(forward_registered);
+        guardian->visitReady(forwarder);
+    }
+
+    for (Page* page : sources)
+        releasePage(page);
+}
+
+
+// 途中の古い世代のマークを一度に終わらせる
+void Allocator::completeMarking()
+{
+    if (marker_thread_.joinable())
+        stopMarkerThread();
+    mark_stack_.insert(mark_stack_.end(), satb_buffer_.begin(), satb_buffer_.end());
+    satb_buffer_.clear();
+    drainMarkStack(Clock::time_point::max());
+    finishMarking();
+}
+
+
+void Allocator::compact(Context* ctx)
+{
+    if (in_region_)
+        return;
+    collectYoung(ctx);
+    if (!marking_)
+        startMarking(ctx);
+    completeMarking();
+    evacuateSparsePages(ctx);
+    releaseMemory();
+    updateLimit(Clock::now());
+}
+
+
+// 古い世代の回収が終わったら true を返す
+bool Allocator::collect(Context* ctx)
+{
+    Clock::time_point start = Clock::now();
+    collectYoung(ctx);
+
+    if (!marking_) {
+        if (size_ <= limit_)
+            return false;
+        startMarking(ctx);
+        if (concurrent_) {
+            startMarkerThread();
+            return false;
+        }
+    }
+
+    // マークが割り当てに追いつかず古い世代が膨らみ続けるようなら、一度に終わらせる
+    bool overdue = size_ > marking_start_size_ * 2;
+    if (marker_thread_.joinable()) {
+        if (!handOverToMarker() && !overdue)
+            return false;
+        stopMarkerThread();
+    }
+
+    mark_stack_.insert(mark_stack_.end(), satb_buffer_.begin(), satb_buffer_.end());
+    satb_buffer_.clear();
+    // 若い世代の回収などで使った分も予算から引く
+    Clock::time_point deadline = Clock::time_point::max();
+    if (pause_budget_.count() != 0 && !concurrent_ && !overdue)
+        deadline = start + pause_budget_;
+    if (!drainMarkStack(deadline))
+        return false;
+    finishMarking();
+    if (compact_threshold_ > 0 && fragmentation() > compact_threshold_)
+        evacuateSparsePages(ctx);
+    return true;
+}
+
+
+void Allocator::gc(Context* ctx)
+{
+    // リージョンのオブジェクトは根として辿らないので、リージョンの中では回収できない
+    if (in_region_)
+        return;
+    size_t marked_objects = marking_ ? marked_objects_.load() : 0;
+    size_t marked_bytes = marking_ ? marked_bytes_.load() : 0;
+
+    Clock::time_point start = Clock::now();
+    bool finished = collect(ctx);
+    Clock::time_point end = Clock::now();
+    gc_time_ += end - start;
+    if (finished) {
+        releaseMemory();
+        updateLimit(end);
+    }
+
+    if (stats_ != nullptr) {
+        GcEvent event;
+        event.pause_us = std::chrono::duration<double, std::micro>(end - start).count();
+        event.major = finished;
+        event.promoted_bytes = promoted_bytes_;
+        if (marking_ || finished) {
+            event.marked_objects = marked_objects_ - marked_objects;
+            event.marked_bytes = marked_bytes_ - marked_bytes;
+        }
+        event.freed_objects = freed_objects_;
+        event.freed_bytes = freed_bytes_;
+        event.heap_size = size_;
+        event.limit = limit_;
+        event.committed_bytes = page_space_.getCommittedSize();
+        stats_->record(event);
+        promoted_bytes_ = 0;
+        freed_objects_ = 0;
+        freed_bytes_ = 0;
+    }
 }
 
 
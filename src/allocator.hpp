@@ -1,8 +1,23 @@
 #pragma once
 
-#include <forward_list>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
 #include <utility>
+#include <vector>
+#include "gc_stats.hpp"
 #include "object.hpp"
+#include "page.hpp"
+#include "page_space.hpp"
+#include "reclaimer.hpp"
+#include "worker_pool.hpp"
 
 
 namespace nscheme {
@@ -10,30 +25,381 @@ namespace nscheme {
 struct Context;
 
 
+// 世代別のヒープ。
+// 新しいオブジェクトは若い世代のページに詰めて割り当て、
+// GC の度に生き残ったものを古い世代へコピーする。
+// リストは cdr を先に辿ってコピーし、セルが古い世代のページで隣り合うようにする。
+// 古い世代はサイズクラス毎のページに置き、mark & sweep で回収する。
+// ペアはどちらの世代でもペア専用のページに置く。
+// sweep はマークの直後には行わず、割り当てで空きセルが必要になったページから順に行う。
+// 空きセルの多いページは、生きているオブジェクトを他のページへ移して返すこともできる。
+// 古い世代のマークは snapshot-at-the-beginning 方式で、GC 毎に少しずつ進めることも、
+// 専用のスレッドでインタプリタと並行に進めることもできる。
+// プログラムのリテラルのようにずっと生きているものは、マークも sweep もしない不死のページに置く。
+// 不死のオブジェクトからそれ以外への参照は、書き込みバリアで記憶して GC の度に根として扱う。
+// リージョンの中では GC をせずにすべてをリージョンのページに詰め、抜ける時にまとめて捨てる。
 class Allocator {
 public:
-    ~Allocator()
+    static constexpr size_t kMaxThreads = 256;
+
+    Allocator();
+
+    Allocator(const Allocator&) = delete;
+
+    Allocator& operator=(const Allocator&) = delete;
+
+    ~Allocator();
+
+    template <typename T, typename... Args> T* make(Args&&... args)
     {
-        for (Object* p : objects_)
-            delete p;
+        if (in_region_)
+            return makeInRegion<T>(std::forward<Args>(args)...);
+        if (sizeof(T) <= kMaxSmallSize) {
+            Nursery& nursery = std::is_same<T, PairObject>::value ? pair_nursery_ : nursery_;
+            if (void* cell = nursery.pages[nursery.index]->allocateYoung(sizeof(T)))
+                return commitYoung(new (cell) T(std::forward<Args>(args)...));
+            if (advanceNursery(nursery))
+                return make<T>(std::forward<Args>(args)...);
+        }
+
+        // 若い世代に入らなかったので古い世代に置く。
+        // 若い世代を指しているかもしれないので記憶しておく。
+        T* ptr = makeTenured<T>(std::forward<Args>(args)...);
+        remember(ptr);
+        return ptr;
     }
 
-    template <typename T, typename... Args> T* make(Args&&... args)
+    // 若い世代を経由せずに古い世代に割り当てる。
+    // 命令列などから直接指されていて GC で移動されては困るオブジェクトに使う。
+    template <typename T, typename... Args> T* makeTenured(Args&&... args)
     {
-        T* ptr = new T(std::forward<Args>(args)...);
-        objects_.push_front(ptr);
-        size_ += sizeof(T);
+        if (in_region_)
+            return makeInRegion<T>(std::forward<Args>(args)...);
+        T* ptr = new (allocateOld(sizeof(T), T::kType)) T(std::forward<Args>(args)...);
+        commitOld(ptr);
+        trackWeak(ptr);
         return ptr;
     }
 
-    bool needGc() const { return size_ > limit_; }
+    // 回収しないオブジェクトを割り当てる。Reader が読んだプログラムのデータなどに使う
+    template <typename T, typename... Args> T* makeImmortal(Args&&... args)
+    {
+        if (in_region_)
+            return makeInRegion<T>(std::forward<Args>(args)...);
+        bool pairs = std::is_same<T, PairObject>::value;
+        std::vector<Page*>& pages = pairs ? immortal_pair_pages_ : immortal_pages_;
+        return new (allocateImmortal(pages, sizeof(T), pairs)) T(std::forward<Args>(args)...);
+    }
+
+    bool needGc() const
+    {
+        return !in_region_ && (nursery_full_ || (!marking_ && size_ > limit_));
+    }
+
+    // 古い世代のマークの途中かどうか
+    bool isMarking() const { return marking_; }
 
+    // 若い世代を回収し、古い世代が limit を超えていれば古い世代も回収する
     void gc(Context* ctx);
 
+    // 割り当てをする命令や C の関数はこれを呼んで GC の機会を作る。
+    // 生きている値はすべて ctx のスタックか LocalRoot に置いておかなければならない。
+    void safepoint(Context* ctx)
+    {
+        if (needGc())
+            gc(ctx);
+    }
+
+    // 以後 endRegion() までの割り当てをすべてリージョンに置く。リージョンの中では GC をしない。
+    // 一つのリクエストで一つのスクリプトを動かす時などに、GC と後始末の手間を省く。
+    // リージョンの外のオブジェクトにリージョンのオブジェクトを書き込むと例外を投げる
+    void beginRegion();
+
+    // リージョンで割り当てたものをすべて捨てる。
+    // ページは返さずに次のリージョンで使い回すので、外に配列などを持つオブジェクトを
+    // 破棄するだけで済む。
+    // ctx はリージョンを抜けた後も使う Context で、その根がまだリージョンのオブジェクトを
+    // 指していれば、何も捨てずに std::runtime_error を投げる。
+    // 残したいものは promote() してから根に置き直す
+    void endRegion(Context* ctx);
+
+    bool isInRegion() const { return in_region_; }
+
+    // v から辿れるリージョンのオブジェクトを古い世代に移し、リージョンを抜けても残るようにする。
+    // 移した後の v を返す
+    Value promote(Value v);
+
+    // 若い世代と古い世代をすべて回収してから、空きの多いページの中身を他のページに詰める
+    void compact(Context* ctx);
+
+    // 古い世代を回収した後、ページ中の空きセルの割合がこれを超えていれば compact() する。
+    // 0 なら自動では行わない。
+    void setCompactThreshold(double threshold) { compact_threshold_ = threshold; }
+
+    // 古い世代がこの大きさになるまでは古い世代を回収しない
+    void setInitialLimit(size_t limit) { initial_limit_ = limit_ = limit; }
+
+    // 古い世代を回収した後、生き残った大きさのこの倍率まで次の回収を待つ
+    void setGrowthFactor(double growth) { growth_ = growth; }
+
+    // 0 でなければ、GC に費やす時間の割合がこれに近づくよう倍率を回収毎に調整する
+    void setTargetGcFraction(double fraction) { target_gc_fraction_ = fraction; }
+
+    // gc() の度にその記録を stats に追加する
+    void setStats(GcStats* stats) { stats_ = stats; }
+
+    // 古い世代のマークを一度に終わらせず、gc() を始めてからこの時間が過ぎたら次の gc() に回す。
+    // 縛るのはマークスタックを空にする部分だけで、若い世代の回収やマークの仕上げは縛らない。
+    // 0 なら一度に終わらせる。
+    void setPauseBudget(std::chrono::microseconds budget) { pause_budget_ = budget; }
+
+    // 古い世代のマークをバックグラウンドのスレッドで行う
+    void setConcurrent(bool concurrent) { concurrent_ = concurrent; }
+
+    // 一度に終わらせるマークと sweep をこの数のスレッドで分担する。kMaxThreads を上限とする。
+    // スレッドはここで起こしておき、Allocator を壊すまで使い回す
+    void setThreads(size_t n_threads)
+    {
+        n_threads_ = std::min(std::max(n_threads, size_t(1)), kMaxThreads);
+        workers_.setThreads(n_threads_);
+    }
+
+    // 死んだオブジェクトの大きな配列や空になったページの解放をバックグラウンドのスレッドに任せる
+    void setBackgroundFree(bool enabled) { reclaimer_.reset(enabled ? new Reclaimer() : nullptr); }
+
+    // ヒープのページを 2 MiB の huge page で確保して、TLB ミスを減らす
+    void setHugePages(bool enabled) { page_space_.setHugePages(enabled); }
+
+    // 割り当て後にオブジェクトの外の配列などが bytes だけ大きくなったら呼ぶ
+    static void notifyGrowth(Object* obj, size_t bytes);
+
+    // 弱い参照から読み出した値をインタプリタに渡す前に呼ぶ。
+    // マーク中なら、スナップショットに含まれていなくても生きているものとして扱う。
+    static void readBarrier(const Object* holder, Value value)
+    {
+        Allocator* allocator = Page::of(holder)->getOwner();
+        if (allocator->marking_ && value.isPointer())
+            allocator->recordOverwritten(value.asPointer());
+    }
+
+    // holder が持つ参照を old_value から new_value に書き換える前に呼ぶ
+    static void writeBarrier(Object* holder, Value old_value, Value new_value)
+    {
+        Page* page = Page::of(holder);
+        Allocator* allocator = page->getOwner();
+        if (allocator->marking_ && old_value.isPointer())
+            allocator->recordOverwritten(old_value.asPointer());
+        if (!new_value.isPointer())
+            return;
+        Page* target = Page::of(new_value.asPointer());
+        if (target->isRegion() && !page->isRegion())
+            throw std::runtime_error("cannot store a region object outside the region");
+        if (!page->isYoung() && !page->isRegion() && !page->isRemembered(holder)) {
+            if (target->isYoung() || (page->isImmortal() && !target->isImmortal()))
+                allocator->remember(holder);
+        }
+    }
+
 private:
-    std::forward_list<Object*> objects_;
+    static constexpr size_t kMaxSmallSize = 256;
+    static constexpr size_t kNumSizeClasses = kMaxSmallSize / Page::kCellAlign;
+    static constexpr size_t kPairClass = kNumSizeClasses; // ペア専用のページのサイズクラス
+    static constexpr size_t kNurseryPages = 16;
+    static constexpr size_t kPrefetchDistance = 8;
+    static constexpr size_t kClockCheckInterval = 1024;
+    static constexpr size_t kDefaultInitialLimit = 4 * 1024 * 1024;
+    static constexpr double kMinGrowth = 1.1;
+    static constexpr double kMaxGrowth = 8;
+
+    // 同じサイズクラスのページの集合
+    struct SizeClass {
+        std::vector<Page*> pages;
+        std::vector<Page*> available; // 空きセルがあるかもしれないページ
+        std::vector<Page*> unswept;   // 前回のマークの後まだ sweep していないページ
+        Page* current = nullptr;
+    };
+
+    // 若い世代のページの列。先頭から順に詰めていく
+    struct Nursery {
+        std::vector<Page*> pages;
+        size_t index = 0;
+    };
+
+    struct Evacuator;
+    struct Marker;
+    struct Forwarder;
+    struct Promoter;
+
+    using Clock = std::chrono::steady_clock;
+
+    // 若い世代のオブジェクトがオブジェクトの外に持つ配列なども、
+    // 若い世代のページと同じだけ溜まったら若い世代を回収する
+    template <typename T> T* commitYoung(T* ptr)
+    {
+        young_external_size_ += ptr->T::getExternalSize();
+        if (young_external_size_ > kNurseryPages * Page::kSize)
+            nursery_full_ = true;
+        trackWeak(ptr);
+        return ptr;
+    }
+
+    // リージョンのオブジェクトは GC の対象にならないので、弱い参照も記録しない。
+    // 外に配列などを持つものは、リージョンを抜ける時に破棄するために覚えておく
+    template <typename T, typename... Args> T* makeInRegion(Args&&... args)
+    {
+        static_assert(sizeof(T) <= kMaxSmallSize, "too large for a region page");
+        bool pairs = std::is_same<T, PairObject>::value;
+        void* cell = allocateInRegion(pairs ? region_pairs_ : region_, sizeof(T), pairs);
+        T* ptr = new (cell) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible<T>::value)
+            region_owners_.push_back(ptr);
+        return ptr;
+    }
+
+    // 弱い参照を持つオブジェクトは、GC の後で参照を消せるように覚えておく。
+    // 若い世代の回収で調べるものを絞れるよう、若い世代に割り当てたものは分けておく
+    void trackWeak(Object*) {}
+    void trackWeak(WeakBoxObject* obj) { trackWeakObject(obj); }
+    void trackWeak(EphemeronObject* obj) { trackWeakObject(obj); }
+    void trackWeak(WeakTableObject* obj) { trackWeakObject(obj); }
+    void trackWeak(GuardianObject* obj) { guardians_.push_back(obj); }
+
+    void trackWeakObject(Object* obj)
+    {
+        (Page::of(obj)->isYoung() ? young_weak_objects_ : weak_objects_).push_back(obj);
+    }
+
+    bool advanceNursery(Nursery& nursery);
+    void* allocateOld(size_t size, ObjectType type);
+    void* allocateLarge(size_t size);
+    void* allocateImmortal(std::vector<Page*>& pages, size_t size, bool pairs);
+    void* allocateInRegion(Nursery& region, size_t size, bool pairs);
+
+    // ヒープの使用量として数えたバイト数を返す
+    size_t commitOld(Object* obj)
+    {
+        Page* page = Page::of(obj);
+        page->commit(obj);
+        size_t size = obj->getTotalSize();
+        size_ += size;
+        if (marking_) {
+            page->setMark(obj);
+            marked_objects_++;
+            marked_bytes_ += size;
+        }
+        return size;
+    }
+
+    void remember(Object* obj);
+
+    // マーク中の古い世代のオブジェクトを灰色にする。
+    // 若い世代のオブジェクトはこのサイクルでは生きているものとみなす。
+    void shade(Object* obj)
+    {
+        if (Page::of(obj)->isOld())
+            mark_stack_.push_back(obj);
+    }
+
+    // 書き換えで消える参照を記録しておき、次の gc() でマークスタックに渡す
+    void recordOverwritten(Object* obj)
+    {
+        if (Page::of(obj)->isOld())
+            satb_buffer_.push_back(obj);
+    }
+
+    // 不死のオブジェクトから回収されるオブジェクトへの参照それぞれについて f を呼ぶ
+    template <typename F> void visitImmortalReferences(F& f)
+    {
+        for (Object* obj : immortal_remembered_)
+            visitReferences(obj, f);
+    }
+
+    Object* evacuate(Object* obj);
+    Object* copyToOld(Object* obj);
+    void collectYoung(Context* ctx);
+    bool evacuateEphemeronValues();
+    bool rescueYoungGuarded();
+    void clearYoungWeakReferences();
+    void startMarking(Context* ctx);
+    bool drainMarkStack(Clock::time_point deadline);
+    void markInParallel();
+    bool collect(Context* ctx);
+    void markWeakReachable();
+    void finishMarking();
+    void completeMarking();
+    void dropRegion();
+    void updateLimit(Clock::time_point now);
+    void startMarkerThread();
+    bool handOverToMarker();
+    void stopMarkerThread();
+    void runMarker();
+    void finishSweeping();
+    void releasePage(Page* page);
+    bool releaseIfUnmarked(Page* page);
+    void releaseMemory();
+    double fragmentation() const;
+    void evacuateSparsePages(Context* ctx);
+
+    PageSpace page_space_;
+    Nursery nursery_;
+    Nursery pair_nursery_;
+    bool nursery_full_ = false;
+    size_t young_external_size_ = 0;
+    std::vector<Object*> remembered_;
+    std::vector<Page*> immortal_pages_;
+    std::vector<Page*> immortal_pair_pages_;
+    std::vector<Object*> immortal_remembered_; // 一度入れたら消さない
+    bool in_region_ = false;
+    Nursery region_; // 若い世代と同じく先頭から詰め、リージョンを抜けたら先頭に戻る
+    Nursery region_pairs_;
+    std::vector<Object*> region_owners_; // 破棄しなければならないリージョンのオブジェクト
+    std::vector<Object*> promoted_;
+    std::vector<Object*> weak_objects_;       // 若い世代のもの以外
+    std::vector<Object*> young_weak_objects_; // 前回の若い世代の回収以降に割り当てた若いもの
+    std::vector<Object*> dirty_weak_objects_; // 若い世代の回収中だけ使う。記憶集合にあったもの
+    std::vector<GuardianObject*> guardians_;
+    std::vector<Object*> mark_stack_;
+    std::vector<Object*> satb_buffer_;
+    bool marking_ = false;
+    size_t marking_start_size_ = 0;
+    // マークスレッドと割り当ての両方から足される
+    std::atomic<size_t> marked_objects_{0};
+    std::atomic<size_t> marked_bytes_{0};
+    std::chrono::microseconds pause_budget_{0};
+    size_t n_threads_ = 1;
+    WorkerPool workers_;
+    double compact_threshold_ = 0;
+
+    // 統計用。前回 gc() の記録を取ってからの量
+    GcStats* stats_ = nullptr;
+    size_t promoted_bytes_ = 0;
+    size_t freed_objects_ = 0;
+    size_t freed_bytes_ = 0;
+
+    // 並行マーク用。satb_queue_ と marker_* は marker_mutex_ で保護する。
+    // マークスレッドが動いている間、マークスタックとオブジェクトのマークはマークスレッドのもの。
+    bool concurrent_ = false;
+    std::thread marker_thread_;
+    std::mutex marker_mutex_;
+    std::condition_variable marker_cond_;
+    std::vector<Object*> satb_queue_;
+    bool marker_idle_ = false;
+    bool marker_stop_ = false;
+
+    SizeClass size_classes_[kNumSizeClasses + 1];
+    std::vector<Page*> large_pages_;
     size_t size_ = 0;
-    size_t limit_ = 1024;
+    size_t limit_ = kDefaultInitialLimit;
+    size_t initial_limit_ = kDefaultInitialLimit;
+    double growth_ = 2;
+    double target_gc_fraction_ = 0;
+
+    // 前回古い世代を回収し終えた時刻と、それ以降 gc() にかかった時間
+    Clock::time_point period_start_ = Clock::now();
+    Clock::duration gc_time_{0};
+
+    // 他のメンバより先に破棄して、解放し残しがないようにする
+    std::unique_ptr<Reclaimer> reclaimer_;
 };
 
 
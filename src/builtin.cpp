@@ -1,5 +1,6 @@
 #include "builtin.hpp"
 #include "context.hpp"
+#include "heap_dump.hpp"
 #include "inst.hpp"
 #include "object.hpp"
 
@@ -44,9 +45,15 @@ void callcc(Context* ctx, size_t n_args)
     Value callable = ctx->value_stack.back();
     ctx->value_stack.pop_back();
 
-    ContinuationObject* continuation = ctx->allocator->make<ContinuationObject>(
-        ctx->ip + 1, ctx->value_stack, ctx->control_stack, ctx->frame_stack);
-    ctx->value_stack.push_back(Value::fromPointer(continuation));
+    // スタックを丸ごとコピーするので大きくなりうる
+    Value continuation = Value::fromPointer(ctx->allocator->make<ContinuationObject>(
+        ctx->ip + 1, ctx->value_stack, ctx->control_stack, ctx->frame_stack));
+    {
+        LocalRoot callable_root(ctx, &callable);
+        LocalRoot continuation_root(ctx, &continuation);
+        ctx->allocator->safepoint(ctx);
+    }
+    ctx->value_stack.push_back(continuation);
     ctx->value_stack.push_back(callable);
     ApplyInst(1).exec(ctx);
 }
@@ -94,7 +101,66 @@ bool isPair(Value obj)
 {
     if (!obj.isPointer())
         return false;
-    return dynamic_cast<PairObject*>(obj.asPointer()) != nullptr;
+    return objectCast<PairObject>(obj.asPointer()) != nullptr;
+}
+
+
+// obj が T でなければ message で TypeError を投げる
+template <typename T> T* cast(Value obj, const char* message)
+{
+    T* ptr = obj.isPointer() ? objectCast<T>(obj.asPointer()) : nullptr;
+    if (ptr == nullptr)
+        throw TypeError(message);
+    return ptr;
+}
+
+
+void makeWeakTable(Context* ctx, size_t n_args)
+{
+    if (n_args != 0)
+        throw std::runtime_error("make-weak-table: Invalid number of arguments.");
+    ctx->value_stack.push_back(Value::fromPointer(ctx->allocator->make<WeakTableObject>()));
+}
+
+
+void makeGuardian(Context* ctx, size_t n_args)
+{
+    if (n_args != 0)
+        throw std::runtime_error("make-guardian: Invalid number of arguments.");
+    ctx->value_stack.push_back(Value::fromPointer(ctx->allocator->make<GuardianObject>()));
+}
+
+
+// (weak-table-ref table key default)
+void weakTableRef(Context* ctx, size_t n_args)
+{
+    if (n_args != 3)
+        throw std::runtime_error("weak-table-ref: Invalid number of arguments.");
+    Value default_value = ctx->value_stack.back();
+    ctx->value_stack.pop_back();
+    Value key = ctx->value_stack.back();
+    ctx->value_stack.pop_back();
+    Value table = ctx->value_stack.back();
+    ctx->value_stack.pop_back();
+    auto ptr = cast<WeakTableObject>(table, "weak-table-ref: 1st argument must be a weak table");
+    ctx->value_stack.push_back(ptr->get(key, default_value));
+}
+
+
+// (weak-table-set! table key value)
+void weakTableSet(Context* ctx, size_t n_args)
+{
+    if (n_args != 3)
+        throw std::runtime_error("weak-table-set!: Invalid number of arguments.");
+    Value value = ctx->value_stack.back();
+    ctx->value_stack.pop_back();
+    Value key = ctx->value_stack.back();
+    ctx->value_stack.pop_back();
+    Value table = ctx->value_stack.back();
+    ctx->value_stack.pop_back();
+    auto ptr = cast<WeakTableObject>(table, "weak-table-set!: 1st argument must be a weak table");
+    ptr->set(key, value);
+    ctx->value_stack.push_back(Value::Nil);
 }
 
 
@@ -193,6 +259,63 @@ void registerBuiltinFunctions(std::unordered_map<Symbol, Value>* variables, Allo
         return Value::Nil;
     });
 
+    registerFunction1(variables, allocator, symbol_table, "make-weak-box",
+                      [](Context* ctx, Value obj) {
+        return Value::fromPointer(ctx->allocator->make<WeakBoxObject>(obj));
+    });
+
+    registerFunction1(variables, allocator, symbol_table, "weak-box-value", [](Context*, Value b) {
+        return cast<WeakBoxObject>(b, "weak-box-value: 1st argument must be a weak box")
+            ->getValue();
+    });
+
+    registerFunction2(variables, allocator, symbol_table, "make-ephemeron",
+                      [](Context* ctx, Value key, Value value) {
+        return Value::fromPointer(ctx->allocator->make<EphemeronObject>(key, value));
+    });
+
+    registerFunction1(variables, allocator, symbol_table, "ephemeron-key", [](Context*, Value e) {
+        return cast<EphemeronObject>(e, "ephemeron-key: 1st argument must be an ephemeron")
+            ->getKey();
+    });
+
+    registerFunction1(variables, allocator, symbol_table, "ephemeron-value", [](Context*, Value e) {
+        return cast<EphemeronObject>(e, "ephemeron-value: 1st argument must be an ephemeron")
+            ->getValue();
+    });
+
+    variables->insert(std::make_pair(
+        symbol_table->intern("make-weak-table"),
+        Value::fromPointer(allocator->make<CFunctionObject>(makeWeakTable, "make-weak-table"))));
+
+    variables->insert(std::make_pair(
+        symbol_table->intern("weak-table-ref"),
+        Value::fromPointer(allocator->make<CFunctionObject>(weakTableRef, "weak-table-ref"))));
+
+    variables->insert(std::make_pair(
+        symbol_table->intern("weak-table-set!"),
+        Value::fromPointer(allocator->make<CFunctionObject>(weakTableSet, "weak-table-set!"))));
+
+    variables->insert(std::make_pair(
+        symbol_table->intern("make-guardian"),
+        Value::fromPointer(allocator->make<CFunctionObject>(makeGuardian, "make-guardian"))));
+
+    registerFunction2(variables, allocator, symbol_table, "guardian-register!",
+                      [](Context*, Value g, Value obj) {
+        cast<GuardianObject>(g, "guardian-register!: 1st argument must be a guardian")->add(obj);
+        return Value::Nil;
+    });
+
+    registerFunction1(variables, allocator, symbol_table, "guardian-next", [](Context*, Value g) {
+        return cast<GuardianObject>(g, "guardian-next: 1st argument must be a guardian")->next();
+    });
+
+    registerFunction1(variables, allocator, symbol_table, "dump-heap", [](Context* ctx, Value f) {
+        dumpHeap(ctx,
+                 cast<StringObject>(f, "dump-heap: 1st argument must be a string")->getString());
+        return Value::Nil;
+    });
+
     auto callcc_f = allocator->make<CFunctionObject>(callcc, "call-with-current-continuation");
     variables->insert(std::make_pair(symbol_table->intern("call-with-current-continuation"),
                                      Value::fromPointer(callcc_f)));
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include "page.hpp"
+
+
+namespace nscheme {
+
+
+// ヒープ上のオブジェクトから同じヒープの T への参照。
+// NSCHEME_COMPRESSED_REFS を定義してビルドすると 32 ビットに縮める
+// (make COMPRESSED_REFS=1)。その場合は自分のいるページの先頭からの距離を
+// Page::kCellAlign 単位で持ち、0 は nullptr を表す。PageSpace が普通のページを
+// 32 GiB までの予約領域から切り出すので、距離は必ず 32 ビットに収まる。
+// コピーすると新しい場所からの距離に直すので、GC でオブジェクトごと移動してよい。
+// 縮めるのは Frame の親と ClosureObject のフレームだけで、即値も入る Value はそのまま。
+// 若い世代の回収が書き換えるのを並行マークのスレッドが読むので、読み書きは不可分に行う。
+template <typename T> class CompressedRef {
+public:
+    CompressedRef(T* ptr) { set(ptr); }
+
+    CompressedRef(const CompressedRef& other) { set(other.get()); }
+
+    CompressedRef& operator=(const CompressedRef& other)
+    {
+        set(other.get());
+        return *this;
+    }
+
+#ifdef NSCHEME_COMPRESSED_REFS
+    T* get() const
+    {
+        int32_t offset = __atomic_load_n(&offset_, __ATOMIC_ACQUIRE);
+        if (offset == 0)
+            return nullptr;
+        return reinterpret_cast<T*>(base() + static_cast<intptr_t>(offset) * Page::kCellAlign);
+    }
+
+    void set(T* ptr)
+    {
+        int32_t offset = 0;
+        if (ptr != nullptr) {
+            intptr_t distance = reinterpret_cast<intptr_t>(ptr) - base();
+            offset = static_cast<int32_t>(distance / static_cast<intptr_t>(Page::kCellAlign));
+        }
+        __atomic_store_n(&offset_, offset, __ATOMIC_RELEASE);
+    }
+#else
+    T* get() const { return __atomic_load_n(&ptr_, __ATOMIC_ACQUIRE); }
+
+    void set(T* ptr) { __atomic_store_n(&ptr_, ptr, __ATOMIC_RELEASE); }
+#endif
+
+    // 参照を T*& として f に渡し、書き換えられていれば書き戻す
+    template <typename F> void visit(F& f)
+    {
+        T* ptr = get();
+        T* original = ptr;
+        f(ptr);
+        if (ptr != original)
+            set(ptr);
+    }
+
+private:
+#ifdef NSCHEME_COMPRESSED_REFS
+    intptr_t base() const { return reinterpret_cast<intptr_t>(Page::of(this)); }
+
+    int32_t offset_ = 0;
+#else
+    T* ptr_ = nullptr;
+#endif
+};
+
+
+} // namespace nscheme
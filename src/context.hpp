@@ -17,8 +17,30 @@ struct Context {
     std::vector<Frame*> frame_stack;
     std::vector<Value> literals;
     std::unordered_map<Symbol, Value> named_variables;
+    std::vector<Value*> local_roots;
     Allocator* allocator;
 };
 
 
+// C の関数がスタックから下ろした値を持ったまま GC を起こしうる時、その変数を GC に教える。
+// GC でオブジェクトが移動すれば変数も書き換えられる。
+class LocalRoot {
+public:
+    LocalRoot(Context* ctx, Value* slot)
+        : ctx_(ctx)
+    {
+        ctx_->local_roots.push_back(slot);
+    }
+
+    LocalRoot(const LocalRoot&) = delete;
+
+    LocalRoot& operator=(const LocalRoot&) = delete;
+
+    ~LocalRoot() { ctx_->local_roots.pop_back(); }
+
+private:
+    Context* ctx_;
+};
+
+
 } // namespace nscheme
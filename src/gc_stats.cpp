@@ -0,0 +1,85 @@
+#include "gc_stats.hpp"
+#include <algorithm>
+#include <cmath>
+
+
+namespace nscheme {
+
+
+double GcStats::getPausePercentile(double p) const
+{
+    if (events_.empty())
+        return 0;
+    std::vector<double> pauses;
+    pauses.reserve(events_.size());
+    for (const GcEvent& event : events_)
+        pauses.push_back(event.pause_us);
+    std::sort(pauses.begin(), pauses.end());
+    size_t rank = static_cast<size_t>(std::ceil(p / 100 * pauses.size()));
+    return pauses[rank > 0 ? rank - 1 : 0];
+}
+
+
+void GcStats::writeJson(FILE* out) const
+{
+    double total_pause_us = 0;
+    size_t n_major = 0;
+    size_t freed_bytes = 0;
+    for (const GcEvent& event : events_) {
+        total_pause_us += event.pause_us;
+        n_major += event.major;
+        freed_bytes += event.freed_bytes;
+    }
+
+    std::fprintf(out, "{\n");
+    std::fprintf(out, "  \"collections\": %zu,\n", events_.size());
+    std::fprintf(out, "  \"major_collections\": %zu,\n", n_major);
+    std::fprintf(out, "  \"total_pause_us\": %.1f,\n", total_pause_us);
+    std::fprintf(out, "  \"freed_bytes\": %zu,\n", freed_bytes);
+
+    std::fprintf(out, "  \"pause_percentiles_us\": {");
+    const double percentiles[] = {50, 90, 99, 99.9, 100};
+    const char* names[] = {"p50", "p90", "p99", "p99.9", "max"};
+    for (size_t i = 0; i < 5; ++i)
+        std::fprintf(out, "%s\"%s\": %.1f", i ? ", " : "", names[i],
+                     getPausePercentile(percentiles[i]));
+    std::fprintf(out, "},\n");
+
+    // 2 のべき乗マイクロ秒毎のバケツ。le はバケツの上限
+    std::vector<size_t> histogram;
+    for (const GcEvent& event : events_) {
+        size_t bucket = 0;
+        while (double(uint64_t(1) << bucket) < event.pause_us)
+            bucket++;
+        if (histogram.size() <= bucket)
+            histogram.resize(bucket + 1);
+        histogram[bucket]++;
+    }
+    std::fprintf(out, "  \"pause_histogram_us\": [");
+    const char* separator = "";
+    for (size_t i = 0; i < histogram.size(); ++i) {
+        if (histogram[i] == 0)
+            continue;
+        std::fprintf(out, "%s{\"le\": %llu, \"count\": %zu}", separator,
+                     static_cast<unsigned long long>(uint64_t(1) << i), histogram[i]);
+        separator = ", ";
+    }
+    std::fprintf(out, "],\n");
+
+    std::fprintf(out, "  \"events\": [");
+    for (size_t i = 0; i < events_.size(); ++i) {
+        const GcEvent& e = events_[i];
+        std::fprintf(out,
+                     "%s\n    {\"pause_us\": %.1f, \"major\": %s, \"promoted_bytes\": %zu, "
+                     "\"marked_objects\": %zu, \"marked_bytes\": %zu, \"freed_objects\": %zu, "
+                     "\"freed_bytes\": %zu, \"heap_size\": %zu, \"limit\": %zu, "
+                     "\"committed_bytes\": %zu}",
+                     i ? "," : "", e.pause_us, e.major ? "true" : "false", e.promoted_bytes,
+                     e.marked_objects, e.marked_bytes, e.freed_objects, e.freed_bytes, e.heap_size,
+                     e.limit, e.committed_bytes);
+    }
+    std::fprintf(out, "\n  ]\n}\n");
+}
+
+
+} // namespace nscheme
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+
+namespace nscheme {
+
+
+// gc() 一回分の記録
+struct GcEvent {
+    double pause_us = 0;
+    bool major = false; // 古い世代の回収がこの gc() で終わったかどうか
+    size_t promoted_bytes = 0;
+    size_t marked_objects = 0;
+    size_t marked_bytes = 0;
+    size_t freed_objects = 0; // 前回の gc() 以降に解放したもの
+    size_t freed_bytes = 0;
+    size_t heap_size = 0;
+    size_t limit = 0;
+    size_t committed_bytes = 0; // ヒープのページが使いうる物理メモリ
+};
+
+
+// --gc-stats 用。gc() 毎の記録を溜めておき、最後に JSON でまとめて書き出す
+class GcStats {
+public:
+    void record(const GcEvent& event) { events_.push_back(event); }
+
+    const std::vector<GcEvent>& getEvents() const { return events_; }
+
+    // 停止時間の p パーセンタイル
+    double getPausePercentile(double p) const;
+
+    void writeJson(FILE* out) const;
+
+private:
+    std::vector<GcEvent> events_;
+};
+
+
+} // namespace nscheme
@@ -0,0 +1,238 @@
+#include "heap_dump.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+#include "context.hpp"
+#include "object.hpp"
+
+
+namespace {
+
+using namespace nscheme;
+
+
+const char* typeName(ObjectType type)
+{
+    switch (type) {
+    case ObjectType::kString:
+        return "StringObject";
+    case ObjectType::kReal:
+        return "RealObject";
+    case ObjectType::kPair:
+        return "PairObject";
+    case ObjectType::kVector:
+        return "VectorObject";
+    case ObjectType::kFrame:
+        return "Frame";
+    case ObjectType::kClosure:
+        return "ClosureObject";
+    case ObjectType::kCFunction:
+        return "CFunctionObject";
+    case ObjectType::kContinuation:
+        return "ContinuationObject";
+    case ObjectType::kWeakBox:
+        return "WeakBoxObject";
+    case ObjectType::kEphemeron:
+        return "EphemeronObject";
+    case ObjectType::kWeakTable:
+        return "WeakTableObject";
+    case ObjectType::kGuardian:
+        return "GuardianObject";
+    case ObjectType::kForwarded:
+        return "ForwardedObject";
+    }
+    return "Object";
+}
+
+
+std::string escapeJson(const std::string& str)
+{
+    std::string buffer;
+    for (char ch : str) {
+        if (ch == '"' || ch == '\\') {
+            buffer.push_back('\\');
+            buffer.push_back(ch);
+        }
+        else if (static_cast<unsigned char>(ch) < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", ch);
+            buffer += escaped;
+        }
+        else {
+            buffer.push_back(ch);
+        }
+    }
+    return buffer;
+}
+
+
+constexpr size_t kNone = SIZE_MAX;
+
+
+// 根から幅優先で辿ったオブジェクトの参照グラフ
+struct HeapGraph {
+    struct Root {
+        const char* kind;
+        std::string name;
+        size_t node;
+    };
+
+    struct Node {
+        Object* obj;
+        size_t root;     // 根から直接指されていればその番号、そうでなければ kNone
+        size_t retainer; // 最初にこのノードを指したノード
+        std::vector<size_t> refs;
+    };
+
+    std::unordered_map<Object*, size_t> ids;
+    std::vector<Root> roots;
+    std::vector<Node> nodes;
+
+    // 今辿っているノード。根を辿っている間は kNone で、その根の種類と名前を root_* に置く
+    size_t current = kNone;
+    const char* root_kind = "";
+    std::string root_name;
+
+    void operator()(Value& v)
+    {
+        if (v.isPointer())
+            reach(v.asPointer());
+    }
+
+    void operator()(Frame*& frame)
+    {
+        if (frame != nullptr)
+            reach(frame);
+    }
+
+    void reach(Object* obj)
+    {
+        auto it = ids.find(obj);
+        size_t id = it != ids.end() ? it->second : nodes.size();
+        if (it == ids.end()) {
+            ids.emplace(obj, id);
+            nodes.push_back(Node{obj, current == kNone ? roots.size() : kNone, current, {}});
+        }
+        if (current == kNone)
+            roots.push_back(Root{root_kind, root_name, id});
+        else
+            nodes[current].refs.push_back(id);
+    }
+
+    void visitRoot(const char* kind, size_t index, Value& v)
+    {
+        root_kind = kind;
+        root_name = std::to_string(index);
+        (*this)(v);
+    }
+
+    void build(Context* ctx)
+    {
+        for (size_t i = 0; i < ctx->value_stack.size(); ++i)
+            visitRoot("value_stack", i, ctx->value_stack[i]);
+        root_kind = "frame_stack";
+        for (size_t i = 0; i < ctx->frame_stack.size(); ++i) {
+            root_name = std::to_string(i);
+            (*this)(ctx->frame_stack[i]);
+        }
+        for (size_t i = 0; i < ctx->literals.size(); ++i)
+            visitRoot("literals", i, ctx->literals[i]);
+        root_kind = "named_variables";
+        for (auto& pair : ctx->named_variables) {
+            root_name = pair.first.toString();
+            (*this)(pair.second);
+        }
+        for (size_t i = 0; i < ctx->local_roots.size(); ++i)
+            visitRoot("local_roots", i, *ctx->local_roots[i]);
+
+        for (current = 0; current < nodes.size(); ++current) {
+            Object* obj = nodes[current].obj;
+            visitReferences(obj, *this);
+            if (obj->getType() == ObjectType::kGuardian)
+                static_cast<GuardianObject*>(obj)->visitReady(*this);
+        }
+    }
+};
+
+
+} // namespace
+
+
+namespace nscheme {
+
+
+void writeHeapDump(Context* ctx, FILE* out)
+{
+    HeapGraph graph;
+    graph.build(ctx);
+
+    struct Census {
+        const char* type;
+        size_t count;
+        size_t bytes;
+    };
+    std::vector<Census> census;
+    size_t total_bytes = 0;
+    for (const HeapGraph::Node& node : graph.nodes) {
+        const char* type = typeName(node.obj->getType());
+        auto it = std::find_if(census.begin(), census.end(),
+                               [type](const Census& c) { return c.type == type; });
+        if (it == census.end())
+            it = census.insert(census.end(), Census{type, 0, 0});
+        size_t bytes = node.obj->getTotalSize();
+        it->count++;
+        it->bytes += bytes;
+        total_bytes += bytes;
+    }
+    std::sort(census.begin(), census.end(),
+              [](const Census& a, const Census& b) { return a.bytes > b.bytes; });
+
+    std::fprintf(out, "{\n");
+    std::fprintf(out, "  \"objects_total\": %zu,\n", graph.nodes.size());
+    std::fprintf(out, "  \"bytes_total\": %zu,\n", total_bytes);
+
+    std::fprintf(out, "  \"census\": [");
+    for (size_t i = 0; i < census.size(); ++i)
+        std::fprintf(out, "%s\n    {\"type\": \"%s\", \"count\": %zu, \"bytes\": %zu}",
+                     i ? "," : "", census[i].type, census[i].count, census[i].bytes);
+    std::fprintf(out, "\n  ],\n");
+
+    std::fprintf(out, "  \"roots\": [");
+    for (size_t i = 0; i < graph.roots.size(); ++i) {
+        const HeapGraph::Root& root = graph.roots[i];
+        std::fprintf(out, "%s\n    {\"kind\": \"%s\", \"name\": \"%s\", \"object\": %zu}",
+                     i ? "," : "", root.kind, escapeJson(root.name).c_str(), root.node);
+    }
+    std::fprintf(out, "\n  ],\n");
+
+    // retainer か root のどちらか一方を持つ
+    std::fprintf(out, "  \"objects\": [");
+    for (size_t i = 0; i < graph.nodes.size(); ++i) {
+        const HeapGraph::Node& node = graph.nodes[i];
+        std::fprintf(out, "%s\n    {\"id\": %zu, \"type\": \"%s\", \"bytes\": %zu, ", i ? "," : "",
+                     i, typeName(node.obj->getType()), node.obj->getTotalSize());
+        if (node.root != kNone)
+            std::fprintf(out, "\"root\": %zu, \"refs\": [", node.root);
+        else
+            std::fprintf(out, "\"retainer\": %zu, \"refs\": [", node.retainer);
+        for (size_t j = 0; j < node.refs.size(); ++j)
+            std::fprintf(out, "%s%zu", j ? ", " : "", node.refs[j]);
+        std::fprintf(out, "]}");
+    }
+    std::fprintf(out, "\n  ]\n}\n");
+}
+
+
+void dumpHeap(Context* ctx, const std::string& filename)
+{
+    FILE* out = std::fopen(filename.c_str(), "w");
+    if (out == nullptr)
+        throw std::runtime_error("Failed to open file: " + filename);
+    writeHeapDump(ctx, out);
+    std::fclose(out);
+}
+
+
+} // namespace nscheme
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+
+
+namespace nscheme {
+
+struct Context;
+
+
+// ctx の根から辿れるオブジェクトを型毎に数えた結果と、オブジェクトの参照グラフを JSON で書く。
+// 各オブジェクトには根から幅優先で辿った時の一つ手前 (retainer) を付けるので、
+// retainer を順に遡れば、そのオブジェクトを生かしている根までの経路がわかる。
+// 弱い参照は辿らない。
+void writeHeapDump(Context* ctx, FILE* out);
+
+// filename に writeHeapDump() する。開けなければ std::runtime_error を投げる
+void dumpHeap(Context* ctx, const std::string& filename);
+
+
+} // namespace nscheme
@@ -46,8 +46,7 @@ void LoadClosureInst::exec(Context* ctx)
         = ctx->allocator->make<ClosureObject>(label_, frame, arg_size_, frame_size_);
     ctx->value_stack.push_back(Value::fromPointer(closure));
     ctx->ip++;
-    if (ctx->allocator->needGc())
-        ctx->allocator->gc(ctx);
+    ctx->allocator->safepoint(ctx);
 }
 
 
@@ -56,7 +55,7 @@ void ApplyInst::exec(Context* ctx)
     Value v = ctx->value_stack.back();
     ctx->value_stack.pop_back();
     if (v.isPointer()) {
-        if (auto closure = dynamic_cast<ClosureObject*>(v.asPointer())) {
+        if (auto closure = objectCast<ClosureObject>(v.asPointer())) {
             if (closure->getArgSize() != n_args_)
                 throw std::runtime_error("invalid number of arguments");
 
@@ -75,23 +74,25 @@ void ApplyInst::exec(Context* ctx)
                 ctx->frame_stack.push_back(frame);
             }
             ctx->ip = closure->getLabel()->getLocation();
-
-            if (ctx->allocator->needGc())
-                ctx->allocator->gc(ctx);
+            ctx->allocator->safepoint(ctx);
             return;
         }
-        if (auto cfunction = dynamic_cast<CFunctionObject*>(v.asPointer())) {
+        if (auto cfunction = objectCast<CFunctionObject>(v.asPointer())) {
             cfunction->call(ctx, n_args_);
             ctx->ip++;
+            ctx->allocator->safepoint(ctx);
             return;
         }
-        if (auto continuation = dynamic_cast<ContinuationObject*>(v.asPointer())) {
-            std::vector<Value> value_stack = continuation->getValueStack();
+        if (auto continuation = objectCast<ContinuationObject>(v.asPointer())) {
+            auto& saved_values = continuation->getValueStack();
+            std::vector<Value> value_stack(saved_values.begin(), saved_values.end());
             value_stack.insert(value_stack.end(), ctx->value_stack.end() - n_args_,
                                ctx->value_stack.end());
             ctx->value_stack = std::move(value_stack);
-            ctx->control_stack = continuation->getControlStack();
-            ctx->frame_stack = continuation->getFrameStack();
+            auto& saved_controls = continuation->getControlStack();
+            ctx->control_stack.assign(saved_controls.begin(), saved_controls.end());
+            auto& saved_frames = continuation->getFrameStack();
+            ctx->frame_stack.assign(saved_frames.begin(), saved_frames.end());
             ctx->ip = continuation->getInstrunctionPointer();
             return;
         }
@@ -119,7 +120,7 @@ void IndexedAssignInst::exec(Context* ctx)
     Frame* frame = ctx->frame_stack.back();
     for (size_t i = 0; i < frame_index_; ++i)
         frame = frame->getParent();
-    frame->getVariables()[variable_index_] = ctx->value_stack.back();
+    frame->setVariable(variable_index_, ctx->value_stack.back());
     ctx->value_stack.pop_back();
     ctx->value_stack.push_back(Value::Nil);
     ctx->ip++;
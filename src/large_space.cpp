@@ -0,0 +1,49 @@
+#include "large_space.hpp"
+#include <sys/mman.h>
+#include <cstdint>
+
+
+namespace nscheme {
+
+
+namespace {
+
+
+void* mapAligned(size_t bytes, size_t alignment, int prot, int flags)
+{
+    // 余分に確保してから、境界に合わない前後を返す
+    size_t mapped = bytes + alignment;
+    void* memory = mmap(nullptr, mapped, prot, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    if (memory == MAP_FAILED)
+        throw std::bad_alloc();
+
+    uintptr_t start = reinterpret_cast<uintptr_t>(memory);
+    uintptr_t aligned = (start + alignment - 1) & ~(alignment - 1);
+    if (aligned != start)
+        munmap(memory, aligned - start);
+    size_t tail = start + mapped - (aligned + bytes);
+    if (tail != 0)
+        munmap(reinterpret_cast<void*>(aligned + bytes), tail);
+    return reinterpret_cast<void*>(aligned);
+}
+
+
+} // namespace
+
+
+void* mapLargeSpace(size_t bytes, size_t alignment)
+{
+    return mapAligned(bytes, alignment, PROT_READ | PROT_WRITE, 0);
+}
+
+
+void* reserveLargeSpace(size_t bytes, size_t alignment)
+{
+    return mapAligned(bytes, alignment, PROT_NONE, MAP_NORESERVE);
+}
+
+
+void unmapLargeSpace(void* ptr, size_t bytes) { munmap(ptr, bytes); }
+
+
+} // namespace nscheme
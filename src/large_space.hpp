@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+
+namespace nscheme {
+
+
+// これ以上の大きさの配列は malloc を通さずに OS から直接確保する
+constexpr size_t kLargeArrayThreshold = 64 * 1024;
+
+// bytes バイトの領域を alignment 境界に合わせて mmap する。
+// alignment は 2 のべき乗で、OS のページサイズの倍数でなければならない。
+void* mapLargeSpace(size_t bytes, size_t alignment);
+
+// アドレス空間だけを予約する。読み書きできるようにするには MAP_FIXED で mmap し直す
+void* reserveLargeSpace(size_t bytes, size_t alignment);
+
+// 解放した領域はすぐに OS に返る
+void unmapLargeSpace(void* ptr, size_t bytes);
+
+
+// 大きな配列だけを mapLargeSpace() で確保する std::vector 用のアロケータ。
+// 巨大なベクタや継続のスタックの複製が malloc のヒープを断片化させたり、
+// 死んだ後も malloc に抱えられたままになったりしないようにする。
+template <typename T> class LargeArrayAllocator {
+public:
+    using value_type = T;
+
+    LargeArrayAllocator() = default;
+
+    template <typename U> LargeArrayAllocator(const LargeArrayAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n)
+    {
+        size_t bytes = n * sizeof(T);
+        if (bytes < kLargeArrayThreshold)
+            return static_cast<T*>(::operator new(bytes));
+        return static_cast<T*>(mapLargeSpace(roundUp(bytes), kPageAlign));
+    }
+
+    void deallocate(T* ptr, size_t n) noexcept
+    {
+        size_t bytes = n * sizeof(T);
+        if (bytes < kLargeArrayThreshold)
+            ::operator delete(ptr);
+        else
+            unmapLargeSpace(ptr, roundUp(bytes));
+    }
+
+private:
+    static constexpr size_t kPageAlign = 4096;
+
+    static size_t roundUp(size_t bytes)
+    {
+        return (bytes + kPageAlign - 1) / kPageAlign * kPageAlign;
+    }
+};
+
+
+template <typename T> using LargeArray = std::vector<T, LargeArrayAllocator<T>>;
+
+
+template <typename T, typename U>
+bool operator==(const LargeArrayAllocator<T>&, const LargeArrayAllocator<U>&) noexcept
+{
+    return true;
+}
+
+
+template <typename T, typename U>
+bool operator!=(const LargeArrayAllocator<T>&, const LargeArrayAllocator<U>&) noexcept
+{
+    return false;
+}
+
+
+} // namespace nscheme
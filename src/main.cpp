@@ -1,10 +1,13 @@
 #include <algorithm>
+#include <cctype>
 #include <cstdio>
+#include <cstdlib>
 #include <stdexcept>
 #include "argparse.hpp"
 #include "builtin.hpp"
 #include "code.hpp"
 #include "context.hpp"
+#include "heap_dump.hpp"
 #include "inst.hpp"
 #include "parser.hpp"
 #include "reader.hpp"
@@ -156,11 +159,14 @@ Context createContext(std::vector<Inst*>& code, Allocator* allocator,
 }
 
 
+// heap_dump が空でなければ、終了時のヒープをそのファイルに書き出す
 int run(std::vector<Inst*>& code, Allocator* allocator,
-        std::unordered_map<Symbol, Value>& global_variables, bool trace)
+        std::unordered_map<Symbol, Value>& global_variables, bool trace,
+        const std::string& heap_dump)
 {
 
     Context ctx = createContext(code, allocator, global_variables);
+    int rc = 0;
 
     try {
         for (;;) {
@@ -177,33 +183,168 @@ int run(std::vector<Inst*>& code, Allocator* allocator,
     }
     catch (std::runtime_error& e) {
         std::printf("[ERROR] %s\n", e.what());
-        return 1;
+        rc = 1;
     }
 
-    return 0;
+    if (!heap_dump.empty()) {
+        try {
+            dumpHeap(&ctx, heap_dump);
+        }
+        catch (std::runtime_error& e) {
+            std::printf("[ERROR] %s\n", e.what());
+            rc = 1;
+        }
+    }
+    return rc;
 }
 
 
 void usage()
 {
-    puts("Usage: nscheme [--help] [--trace] [FILE]");
+    puts("Usage: nscheme [--help] [--trace] [--gc-pause-us=N] [--gc-concurrent] [--gc-threads=N]");
+    puts("               [--gc-background-free] [--gc-compact=N] [--gc-initial-heap=SIZE]");
+    puts("               [--gc-growth=R] [--gc-target=N] [--gc-stats] [--huge-pages]");
+    puts("               [--heap-dump=FILE] [FILE]");
     puts("Options:");
-    puts("  --help   show this message and exit");
-    puts("  --trace  show internal state of the interpreter");
+    puts("  --help           show this message and exit");
+    puts("  --trace          show internal state of the interpreter");
+    puts("  --gc-pause-us    mark the heap incrementally, stopping after N microseconds per GC;");
+    puts("                   collecting the young generation and finishing a mark are not bounded");
+    puts("  --gc-concurrent  mark the heap in a background thread");
+    puts("  --gc-threads     use N threads to mark and sweep the heap (0: all cores)");
+    puts("  --gc-background-free");
+    puts("                   free dead objects' arrays and empty pages in a background thread");
+    puts("  --gc-compact     compact the heap when more than N% of it is free after a GC");
+    puts("  --gc-initial-heap");
+    puts("                   do not collect the heap until it reaches SIZE bytes (K, M, G)");
+    puts("  --gc-growth      let the heap grow to R times the live data before the next GC");
+    puts("  --gc-target      adjust the growth so that about N% of the time is spent in GC");
+    puts("  --gc-stats       print statistics of each GC as JSON to stderr at exit");
+    puts("  --huge-pages     back the heap with 2 MiB huge pages");
+    puts("  --heap-dump      write live objects and their retainers as JSON to FILE at exit");
+    puts("Environment:");
+    puts("  NSCHEME_GC_INITIAL_HEAP, NSCHEME_GC_GROWTH, NSCHEME_GC_TARGET");
+    puts("                   defaults for --gc-initial-heap, --gc-growth and --gc-target");
+}
+
+
+// std::stoul は負の数も大きな数として読んでしまうので、数字で始まるものだけを受け付ける
+unsigned long parseNumber(const std::string& name, const std::string& value)
+{
+    size_t pos = 0;
+    unsigned long n = 0;
+    try {
+        if (!value.empty() && std::isdigit(static_cast<unsigned char>(value[0])))
+            n = std::stoul(value, &pos);
+    }
+    catch (std::logic_error&) {
+    }
+    if (pos == 0 || pos != value.size())
+        throw ArgumentParseError("Invalid value for '" + name + "': " + value);
+    return n;
+}
+
+
+// K, M, G の接尾辞を付けてもよい
+size_t parseSize(const std::string& name, const std::string& value)
+{
+    size_t pos = 0;
+    unsigned long long n = 0;
+    try {
+        if (!value.empty() && std::isdigit(static_cast<unsigned char>(value[0])))
+            n = std::stoull(value, &pos);
+    }
+    catch (std::logic_error&) {
+    }
+    if (pos != 0 && pos + 1 == value.size()) {
+        switch (value[pos++]) {
+        case 'K':
+        case 'k':
+            n <<= 10;
+            break;
+        case 'M':
+        case 'm':
+            n <<= 20;
+            break;
+        case 'G':
+        case 'g':
+            n <<= 30;
+            break;
+        default:
+            pos = 0;
+        }
+    }
+    if (pos == 0 || pos != value.size())
+        throw ArgumentParseError("Invalid value for '" + name + "': " + value);
+    return n;
+}
+
+
+double parseGrowth(const std::string& name, const std::string& value)
+{
+    size_t pos = 0;
+    double r = 0;
+    try {
+        r = std::stod(value, &pos);
+    }
+    catch (std::logic_error&) {
+    }
+    if (pos == 0 || pos != value.size() || !(r > 1))
+        throw ArgumentParseError("Invalid value for '" + name + "': " + value);
+    return r;
+}
+
+
+unsigned long parsePercent(const std::string& name, const std::string& value)
+{
+    unsigned long n = parseNumber(name, value);
+    if (n > 100)
+        throw ArgumentParseError("Invalid value for '" + name + "': " + value);
+    return n;
 }
 
 
 int main(int argc, char** argv)
 {
     bool trace = false;
+    unsigned long gc_pause_us = 0;
+    bool gc_concurrent = false;
+    unsigned long gc_threads = 1;
+    bool gc_background_free = false;
+    unsigned long gc_compact = 0;
+    size_t gc_initial_heap = 0;
+    double gc_growth = 0;
+    unsigned long gc_target = 0;
+    bool gc_stats = false;
+    bool huge_pages = false;
+    std::string heap_dump;
     std::string filename = "-";
 
     ArgumentParser argparser;
     argparser.addOption("trace", "t", "trace");
     argparser.addOption("help", "h", "help");
+    argparser.addOption("gc-pause-us", "", "gc-pause-us", true);
+    argparser.addOption("gc-concurrent", "", "gc-concurrent");
+    argparser.addOption("gc-threads", "", "gc-threads", true);
+    argparser.addOption("gc-background-free", "", "gc-background-free");
+    argparser.addOption("gc-compact", "", "gc-compact", true);
+    argparser.addOption("gc-initial-heap", "", "gc-initial-heap", true);
+    argparser.addOption("gc-growth", "", "gc-growth", true);
+    argparser.addOption("gc-target", "", "gc-target", true);
+    argparser.addOption("gc-stats", "", "gc-stats");
+    argparser.addOption("huge-pages", "", "huge-pages");
+    argparser.addOption("heap-dump", "", "heap-dump", true);
     argparser.addArgument("filename");
 
     try {
+        // コマンドライン引数の方を優先する
+        if (const char* env = std::getenv("NSCHEME_GC_INITIAL_HEAP"))
+            gc_initial_heap = parseSize("NSCHEME_GC_INITIAL_HEAP", env);
+        if (const char* env = std::getenv("NSCHEME_GC_GROWTH"))
+            gc_growth = parseGrowth("NSCHEME_GC_GROWTH", env);
+        if (const char* env = std::getenv("NSCHEME_GC_TARGET"))
+            gc_target = parsePercent("NSCHEME_GC_TARGET", env);
+
         auto args = argparser.parse(argc, argv);
         if (args.count("help")) {
             usage();
@@ -212,6 +353,44 @@ int main(int argc, char** argv)
         if (args.count("trace")) {
             trace = true;
         }
+        if (args.count("gc-pause-us")) {
+            gc_pause_us = parseNumber("--gc-pause-us", args["gc-pause-us"]);
+        }
+        if (args.count("gc-concurrent")) {
+            gc_concurrent = true;
+        }
+        if (args.count("gc-threads")) {
+            gc_threads = parseNumber("--gc-threads", args["gc-threads"]);
+            if (gc_threads > Allocator::kMaxThreads)
+                throw ArgumentParseError("Too many threads for '--gc-threads': "
+                                         + args["gc-threads"]);
+            if (gc_threads == 0)
+                gc_threads = std::thread::hardware_concurrency();
+        }
+        if (args.count("gc-background-free")) {
+            gc_background_free = true;
+        }
+        if (args.count("gc-compact")) {
+            gc_compact = parsePercent("--gc-compact", args["gc-compact"]);
+        }
+        if (args.count("gc-initial-heap")) {
+            gc_initial_heap = parseSize("--gc-initial-heap", args["gc-initial-heap"]);
+        }
+        if (args.count("gc-growth")) {
+            gc_growth = parseGrowth("--gc-growth", args["gc-growth"]);
+        }
+        if (args.count("gc-target")) {
+            gc_target = parsePercent("--gc-target", args["gc-target"]);
+        }
+        if (args.count("gc-stats")) {
+            gc_stats = true;
+        }
+        if (args.count("huge-pages")) {
+            huge_pages = true;
+        }
+        if (args.count("heap-dump")) {
+            heap_dump = args["heap-dump"];
+        }
         if (args.count("filename")) {
             filename = args["filename"];
         }
@@ -224,6 +403,20 @@ int main(int argc, char** argv)
 
     SymbolTable symbol_table;
     Allocator allocator;
+    allocator.setPauseBudget(std::chrono::microseconds(gc_pause_us));
+    allocator.setConcurrent(gc_concurrent);
+    allocator.setThreads(gc_threads);
+    allocator.setBackgroundFree(gc_background_free);
+    allocator.setHugePages(huge_pages);
+    allocator.setCompactThreshold(gc_compact / 100.0);
+    if (gc_initial_heap != 0)
+        allocator.setInitialLimit(gc_initial_heap);
+    if (gc_growth != 0)
+        allocator.setGrowthFactor(gc_growth);
+    allocator.setTargetGcFraction(gc_target / 100.0);
+    GcStats stats;
+    if (gc_stats)
+        allocator.setStats(&stats);
     SourceMap source_map;
 
     try {
@@ -261,7 +454,9 @@ int main(int argc, char** argv)
                 std::printf("%s\n", inst->toString().c_str());
         }
 
-        int rc = run(code, &allocator, global_variables, trace);
+        int rc = run(code, &allocator, global_variables, trace, heap_dump);
+        if (gc_stats)
+            stats.writeJson(stderr);
 
         for (Inst* inst : code)
             delete inst;
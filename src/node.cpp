@@ -18,10 +18,10 @@ bool isSelfEvaluating(Value value)
     if (value == Value::False)
         return true;
     if (value.isPointer()) {
-        auto p1 = dynamic_cast<StringObject*>(value.asPointer());
+        auto p1 = objectCast<StringObject>(value.asPointer());
         if (p1 != nullptr)
             return true;
-        auto p2 = dynamic_cast<RealObject*>(value.asPointer());
+        auto p2 = objectCast<RealObject>(value.asPointer());
         if (p2 != nullptr)
             return true;
     }
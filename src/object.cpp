@@ -1,23 +1,104 @@
 #include "object.hpp"
 #include <cctype>
 #include <cstdio>
+#include <stdexcept>
+#include "allocator.hpp"
+#include "reclaimer.hpp"
+
+
+namespace {
+
+using namespace nscheme;
+
+
+// obj を実際の型にキャストして f に渡す
+template <typename F>
+auto withActualType(Object* obj, F f) -> decltype(f(static_cast<PairObject*>(obj)))
+{
+    switch (obj->getType()) {
+    case ObjectType::kString:
+        return f(static_cast<StringObject*>(obj));
+    case ObjectType::kReal:
+        return f(static_cast<RealObject*>(obj));
+    case ObjectType::kPair:
+        return f(static_cast<PairObject*>(obj));
+    case ObjectType::kVector:
+        return f(static_cast<VectorObject*>(obj));
+    case ObjectType::kFrame:
+        return f(static_cast<Frame*>(obj));
+    case ObjectType::kClosure:
+        return f(static_cast<ClosureObject*>(obj));
+    case ObjectType::kCFunction:
+        return f(static_cast<CFunctionObject*>(obj));
+    case ObjectType::kContinuation:
+        return f(static_cast<ContinuationObject*>(obj));
+    case ObjectType::kWeakBox:
+        return f(static_cast<WeakBoxObject*>(obj));
+    case ObjectType::kEphemeron:
+        return f(static_cast<EphemeronObject*>(obj));
+    case ObjectType::kWeakTable:
+        return f(static_cast<WeakTableObject*>(obj));
+    case ObjectType::kGuardian:
+        return f(static_cast<GuardianObject*>(obj));
+    case ObjectType::kForwarded:
+        return f(static_cast<ForwardedObject*>(obj));
+    }
+    throw std::logic_error("withActualType: unexpected object type");
+}
+
+
+struct ToString {
+    template <typename T> std::string operator()(T* obj) const { return obj->toString(); }
+};
+
+
+struct Size {
+    template <typename T> size_t operator()(T* obj) const { return obj->size(); }
+};
+
+
+struct ExternalSize {
+    template <typename T> size_t operator()(T* obj) const { return obj->getExternalSize(); }
+};
+
+
+struct Destroy {
+    Reclaimer* reclaimer;
+
+    template <typename T> void operator()(T* obj) const
+    {
+        if (reclaimer != nullptr && obj->getExternalSize() >= Reclaimer::kMinExternalSize)
+            reclaimer->destroyLater(obj);
+        else
+            obj->~T();
+    }
+};
+
+
+} // namespace
 
 
 namespace nscheme {
 
 
-void PairObject::mark()
+std::string Object::toString() const
 {
-    if (marked_)
-        return;
-    marked_ = true;
-    if (car_.isPointer())
-        car_.asPointer()->mark();
-    if (cdr_.isPointer())
-        cdr_.asPointer()->mark();
+    return withActualType(const_cast<Object*>(this), ToString());
+}
+
+
+size_t Object::size() const { return withActualType(const_cast<Object*>(this), Size()); }
+
+
+size_t Object::getExternalSize() const
+{
+    return withActualType(const_cast<Object*>(this), ExternalSize());
 }
 
 
+void Object::destroy(Reclaimer* reclaimer) { withActualType(this, Destroy{reclaimer}); }
+
+
 std::string StringObject::toString() const
 {
     std::string buffer("\"");
@@ -54,6 +135,31 @@ std::string StringObject::toString() const
 }
 
 
+size_t StringObject::getExternalSize() const
+{
+    // 短い文字列はオブジェクトの中に収まっている
+    const char* data = str_.data();
+    const char* self = reinterpret_cast<const char*>(this);
+    if (data >= self && data < self + sizeof(*this))
+        return 0;
+    return str_.capacity() + 1;
+}
+
+
+void PairObject::setCar(Value car)
+{
+    Allocator::writeBarrier(this, car_, car);
+    Value::store(car_, car);
+}
+
+
+void PairObject::setCdr(Value cdr)
+{
+    Allocator::writeBarrier(this, cdr_, cdr);
+    Value::store(cdr_, cdr);
+}
+
+
 std::string PairObject::toString() const
 {
     std::string buffer("(");
@@ -65,8 +171,7 @@ std::string PairObject::toString() const
 
         if (obj->cdr_ == Value::Nil)
             break;
-        if (!cdr_.isPointer()
-            || dynamic_cast<const PairObject*>(obj->cdr_.asPointer()) == nullptr) {
+        if (!obj->cdr_.isPointer() || objectCast<PairObject>(obj->cdr_.asPointer()) == nullptr) {
             buffer += " . ";
             buffer += obj->cdr_.toString();
             break;
@@ -78,6 +183,23 @@ std::string PairObject::toString() const
 }
 
 
+void VectorObject::add(Value value)
+{
+    Allocator::writeBarrier(this, Value::Nil, value);
+    size_t capacity = values_.capacity();
+    values_.push_back(value);
+    if (values_.capacity() != capacity)
+        Allocator::notifyGrowth(this, (values_.capacity() - capacity) * sizeof(Value));
+}
+
+
+void VectorObject::set(size_t index, Value value)
+{
+    Allocator::writeBarrier(this, values_[index], value);
+    Value::store(values_[index], value);
+}
+
+
 std::string VectorObject::toString() const
 {
     std::string buffer("#(");
@@ -91,55 +213,83 @@ std::string VectorObject::toString() const
 }
 
 
-void VectorObject::mark()
+Value WeakBoxObject::getValue() const
 {
-    if (marked_)
-        return;
-    marked_ = true;
-    for (Value v : values_) {
-        if (v.isPointer())
-            v.asPointer()->mark();
-    }
+    Allocator::readBarrier(this, value_);
+    return value_;
 }
 
 
-void Frame::mark()
+Value EphemeronObject::getKey() const
 {
-    if (marked_)
-        return;
-    marked_ = true;
-    if (parent_)
-        parent_->mark();
-    for (auto v : variables_) {
-        if (v.isPointer())
-            v.asPointer()->mark();
-    }
+    Allocator::readBarrier(this, key_);
+    return key_;
 }
 
 
-void ClosureObject::mark()
+Value EphemeronObject::getValue() const
 {
-    if (marked_)
-        return;
-    marked_ = true;
-    frame_->mark();
+    Allocator::readBarrier(this, value_);
+    return value_;
 }
 
 
-void CFunctionObject::mark() { marked_ = true; }
+void GuardianObject::add(Value obj)
+{
+    Allocator::writeBarrier(this, Value::Nil, obj);
+    size_t capacity = registered_.capacity();
+    registered_.push_back(obj);
+    updateExternalSize();
+    if (registered_.capacity() != capacity)
+        Allocator::notifyGrowth(this, (registered_.capacity() - capacity) * sizeof(Value));
+}
 
-void ContinuationObject::mark()
+
+Value GuardianObject::next()
 {
-    if (marked_)
+    if (ready_.empty())
+        return Value::False;
+    Value obj = ready_.front();
+    Allocator::writeBarrier(this, obj, Value::Nil);
+    ready_.pop_front();
+    updateExternalSize();
+    return obj;
+}
+
+
+Value WeakTableObject::get(Value key, Value default_value) const
+{
+    auto it = entries_.find(key);
+    if (it == entries_.end())
+        return default_value;
+    Allocator::readBarrier(this, it->second);
+    return it->second;
+}
+
+
+void WeakTableObject::set(Value key, Value value)
+{
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+        // 若い世代の回収で調べてもらえるよう、キーも書き込みバリアに通す
+        Allocator::writeBarrier(this, Value::Nil, key);
+        Allocator::writeBarrier(this, Value::Nil, value);
+        size_t bucket_count = entries_.bucket_count();
+        entries_.insert(std::make_pair(key, value));
+        updateExternalSize();
+        size_t grown = (entries_.bucket_count() - bucket_count) * sizeof(void*);
+        Allocator::notifyGrowth(this, grown + sizeof(std::pair<Value, Value>) + 2 * sizeof(void*));
         return;
-    marked_ = true;
-    for (Value v : value_stack_) {
-        if (v.isPointer())
-            v.asPointer()->mark();
-    }
-    for (Frame* f : frame_stack_) {
-        f->mark();
     }
+    Allocator::writeBarrier(this, it->second, value);
+    it->second = value;
+}
+
+
+void Frame::setVariable(size_t index, Value value)
+{
+    Allocator::writeBarrier(this, variables_[index], value);
+    Value::store(variables_[index], value);
 }
 
 
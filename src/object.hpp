@@ -1,9 +1,13 @@
 #pragma once
 
+#include <deque>
 #include <functional>
 #include <string>
 #include <unordered_map>
 #include <vector>
+#include "compressed_ref.hpp"
+#include "large_space.hpp"
+#include "page.hpp"
 #include "value.hpp"
 
 
@@ -11,63 +15,139 @@ namespace nscheme {
 
 class Inst;
 class LabelInst;
+class Reclaimer;
 struct Context;
 
 
+enum class ObjectType : uint8_t {
+    kString,
+    kReal,
+    kPair,
+    kVector,
+    kFrame,
+    kClosure,
+    kCFunction,
+    kContinuation,
+    kWeakBox,
+    kEphemeron,
+    kWeakTable,
+    kGuardian,
+    kForwarded,
+};
+
+
+// ヒープ上のオブジェクト。
+// 仮想関数は持たず、型毎の処理は getType() で振り分ける。
+// ペアはペア専用のページに置いて型をページから引くので、ヘッダを持たず 2 ワードに収まる。
+// それ以外のオブジェクトは TaggedObject を継承し、先頭に型を持つ。
 class Object {
 public:
-    virtual ~Object() {}
-    virtual std::string toString() const = 0;
-    virtual void mark() = 0;
-    virtual size_t size() const = 0;
+    ObjectType getType() const noexcept;
+
+    std::string toString() const;
+
+    size_t size() const;
+
+    // オブジェクトの外に確保している配列や文字列のバイト数
+    size_t getExternalSize() const;
+
+    // ヒープの使用量として数えるバイト数
+    size_t getTotalSize() const { return size() + getExternalSize(); }
+
+    // 実際の型のデストラクタを呼ぶ。
+    // reclaimer があれば、外に大きな配列などを持つものはそちらで壊す
+    void destroy(Reclaimer* reclaimer = nullptr);
+
+protected:
+    Object() = default;
+};
 
-    bool isMarked() const { return marked_; }
 
-    void resetMark() { marked_ = false; }
+class TaggedObject : public Object {
+public:
+    size_t getExternalSize() const { return 0; }
 
 protected:
-    bool marked_ = false;
+    explicit TaggedObject(ObjectType type)
+        : type_(type)
+    {
+    }
+
+private:
+    friend class Object;
+
+    ObjectType type_;
 };
 
 
-class StringObject : public Object {
+inline ObjectType Object::getType() const noexcept
+{
+    if (Page::of(this)->holdsPairs())
+        return ObjectType::kPair;
+    return static_cast<const TaggedObject*>(this)->type_;
+}
+
+
+// obj が T なら T* に、そうでなければ nullptr にする
+template <typename T> T* objectCast(Object* obj)
+{
+    return obj->getType() == T::kType ? static_cast<T*>(obj) : nullptr;
+}
+
+
+template <typename T> const T* objectCast(const Object* obj)
+{
+    return obj->getType() == T::kType ? static_cast<const T*>(obj) : nullptr;
+}
+
+
+class StringObject : public TaggedObject {
 public:
+    static constexpr ObjectType kType = ObjectType::kString;
+
     StringObject(const std::string& str)
-        : str_(str)
+        : TaggedObject(kType)
+        , str_(str)
     {
     }
 
-    std::string toString() const override;
+    const std::string& getString() const noexcept { return str_; }
+
+    std::string toString() const;
 
-    void mark() override { marked_ = true; }
+    size_t size() const { return sizeof(*this); }
 
-    size_t size() const override { return sizeof(*this); }
+    size_t getExternalSize() const;
 
 private:
     std::string str_;
 };
 
 
-class RealObject : public Object {
+class RealObject : public TaggedObject {
 public:
+    static constexpr ObjectType kType = ObjectType::kReal;
+
     RealObject(double real)
-        : real_(real)
+        : TaggedObject(kType)
+        , real_(real)
     {
     }
 
-    std::string toString() const override { return std::to_string(real_); }
-
-    void mark() override { marked_ = true; }
+    std::string toString() const { return std::to_string(real_); }
 
-    size_t size() const override { return sizeof(*this); }
+    size_t size() const { return sizeof(*this); }
 
 private:
     double real_;
 };
 
 
+// ヘッダを持たないので、必ずペア専用のページに置く
 class PairObject : public Object {
 public:
+    static constexpr ObjectType kType = ObjectType::kPair;
+
     PairObject(Value car, Value cdr)
         : car_(car)
         , cdr_(cdr)
@@ -78,19 +158,25 @@ public:
 
     const Value getCar() const { return car_; }
 
-    void setCar(Value car) { car_ = car; }
+    void setCar(Value car);
 
     Value getCdr() { return cdr_; }
 
     const Value getCdr() const { return cdr_; }
 
-    void setCdr(Value cdr) { cdr_ = cdr; }
+    void setCdr(Value cdr);
 
-    std::string toString() const override;
+    std::string toString() const;
 
-    void mark() override;
+    size_t size() const { return sizeof(*this); }
 
-    size_t size() const override { return sizeof(*this); }
+    size_t getExternalSize() const { return 0; }
+
+    template <typename F> void visitReferences(F& f)
+    {
+        f(car_);
+        f(cdr_);
+    }
 
 private:
     Value car_;
@@ -98,12 +184,18 @@ private:
 };
 
 
-class VectorObject : public Object {
+class VectorObject : public TaggedObject {
 public:
-    VectorObject() {}
+    static constexpr ObjectType kType = ObjectType::kVector;
+
+    VectorObject()
+        : TaggedObject(kType)
+    {
+    }
 
     VectorObject(size_t length, Value fill)
-        : values_(length, fill)
+        : TaggedObject(kType)
+        , values_(length, fill)
     {
     }
 
@@ -113,54 +205,76 @@ public:
 
     const Value get(size_t index) const { return values_[index]; }
 
-    void add(Value value) { values_.push_back(value); }
+    // 要素の配列を作り直すので、並行マーク中には呼んではいけない (Reader だけが使う)
+    void add(Value value);
 
-    void set(size_t index, Value value) { values_[index] = value; }
+    void set(size_t index, Value value);
 
-    std::string toString() const override;
+    std::string toString() const;
 
-    void mark() override;
+    size_t size() const { return sizeof(*this); }
 
-    size_t size() const override { return sizeof(*this); }
+    size_t getExternalSize() const { return values_.capacity() * sizeof(Value); }
+
+    template <typename F> void visitReferences(F& f)
+    {
+        for (Value& v : values_)
+            f(v);
+    }
 
 private:
-    std::vector<Value> values_;
+    LargeArray<Value> values_;
 };
 
 
-class Frame : public Object {
+// 圧縮した参照を使う時は、親への参照を型タグの後ろの隙間に詰めて 32 バイトに収める
+class Frame : public TaggedObject {
 public:
+    static constexpr ObjectType kType = ObjectType::kFrame;
+
     Frame(Frame* parent, const std::vector<Value>& variables)
-        : parent_(parent)
+        : TaggedObject(kType)
+        , parent_(parent)
         , variables_(variables)
     {
     }
 
-    const Frame* getParent() const { return parent_; }
+    const Frame* getParent() const { return parent_.get(); }
 
-    Frame* getParent() { return parent_; }
+    Frame* getParent() { return parent_.get(); }
 
     const std::vector<Value>& getVariables() const { return variables_; }
 
-    std::vector<Value>& getVariables() { return variables_; }
+    void setVariable(size_t index, Value value);
+
+    std::string toString() const { return "<frame>"; }
 
-    std::string toString() const override { return "<frame>"; }
+    size_t size() const { return sizeof(*this); }
 
-    void mark() override;
+    size_t getExternalSize() const { return variables_.capacity() * sizeof(Value); }
 
-    size_t size() const override { return sizeof(*this); }
+    template <typename F> void visitReferences(F& f)
+    {
+        parent_.visit(f);
+        for (Value& v : variables_)
+            f(v);
+    }
 
 private:
-    Frame* parent_;
+    CompressedRef<Frame> parent_;
     std::vector<Value> variables_;
 };
 
 
-class ClosureObject : public Object {
+// 圧縮した参照を使う時は、フレームへの参照を型タグの後ろの隙間に詰めて 32 バイトに収める
+class ClosureObject : public TaggedObject {
 public:
+    static constexpr ObjectType kType = ObjectType::kClosure;
+
     ClosureObject(LabelInst* label, Frame* frame, size_t arg_size, size_t frame_size)
-        : label_(label)
+        : TaggedObject(kType)
         , frame_(frame)
+        , label_(label)
         , arg_size_(arg_size)
         , frame_size_(frame_size)
     {
@@ -168,44 +282,48 @@ public:
 
     LabelInst* getLabel() const noexcept { return label_; }
 
-    Frame* getFrame() const noexcept { return frame_; }
+    Frame* getFrame() const noexcept { return frame_.get(); }
 
     size_t getArgSize() const noexcept { return arg_size_; }
 
     size_t getFrameSize() const noexcept { return frame_size_; }
 
-    std::string toString() const override
+    std::string toString() const
     {
         return "<closure " + std::to_string((uintptr_t)label_) + ">";
     }
 
-    void mark() override;
+    size_t size() const { return sizeof(*this); }
 
-    size_t size() const override { return sizeof(*this); }
+    template <typename F> void visitReferences(F& f)
+    {
+        frame_.visit(f);
+    }
 
 private:
+    CompressedRef<Frame> frame_;
     LabelInst* label_;
-    Frame* frame_;
     size_t arg_size_;
     size_t frame_size_;
 };
 
 
-class CFunctionObject : public Object {
+class CFunctionObject : public TaggedObject {
 public:
+    static constexpr ObjectType kType = ObjectType::kCFunction;
+
     CFunctionObject(const std::function<void(Context*, size_t)>& func, const std::string& name)
-        : func_(func)
+        : TaggedObject(kType)
+        , func_(func)
         , name_(name)
     {
     }
 
     void call(Context* ctx, size_t n_args) { func_(ctx, n_args); }
 
-    std::string toString() const override { return "<c_function " + name_ + ">"; }
+    std::string toString() const { return "<c_function " + name_ + ">"; }
 
-    void mark() override;
-
-    size_t size() const override { return sizeof(*this); }
+    size_t size() const { return sizeof(*this); }
 
 private:
     std::function<void(Context*, size_t)> func_;
@@ -213,38 +331,308 @@ private:
 };
 
 
-class ContinuationObject : public Object {
+class ContinuationObject : public TaggedObject {
 public:
+    static constexpr ObjectType kType = ObjectType::kContinuation;
+
     ContinuationObject(Inst** ip, const std::vector<Value>& value_stack,
                        const std::vector<Inst**>& control_stack,
                        const std::vector<Frame*>& frame_stack)
-        : ip_(ip)
-        , value_stack_(value_stack)
-        , control_stack_(control_stack)
-        , frame_stack_(frame_stack)
+        : TaggedObject(kType)
+        , ip_(ip)
+        , value_stack_(value_stack.begin(), value_stack.end())
+        , control_stack_(control_stack.begin(), control_stack.end())
+        , frame_stack_(frame_stack.begin(), frame_stack.end())
     {
     }
 
     Inst** getInstrunctionPointer() { return ip_; }
 
-    std::vector<Value>& getValueStack() { return value_stack_; }
+    LargeArray<Value>& getValueStack() { return value_stack_; }
 
-    std::vector<Inst**>& getControlStack() { return control_stack_; }
+    LargeArray<Inst**>& getControlStack() { return control_stack_; }
 
-    std::vector<Frame*>& getFrameStack() { return frame_stack_; }
+    LargeArray<Frame*>& getFrameStack() { return frame_stack_; }
 
-    std::string toString() const override { return "<continuation>"; }
+    std::string toString() const { return "<continuation>"; }
 
-    void mark() override;
+    size_t size() const { return sizeof(*this); }
 
-    size_t size() const override { return sizeof(*this); }
+    size_t getExternalSize() const
+    {
+        return value_stack_.capacity() * sizeof(Value)
+               + control_stack_.capacity() * sizeof(Inst**)
+               + frame_stack_.capacity() * sizeof(Frame*);
+    }
+
+    template <typename F> void visitReferences(F& f)
+    {
+        for (Value& v : value_stack_)
+            f(v);
+        for (Frame*& frame : frame_stack_)
+            f(frame);
+    }
 
 private:
     Inst** ip_;
-    std::vector<Value> value_stack_;
-    std::vector<Inst**> control_stack_;
-    std::vector<Frame*> frame_stack_;
+    LargeArray<Value> value_stack_;
+    LargeArray<Inst**> control_stack_;
+    LargeArray<Frame*> frame_stack_;
+};
+
+
+// 中身を生かしておかない箱。中身が回収されると #f になる
+class WeakBoxObject : public TaggedObject {
+public:
+    static constexpr ObjectType kType = ObjectType::kWeakBox;
+
+    explicit WeakBoxObject(Value value)
+        : TaggedObject(kType)
+        , value_(value)
+    {
+    }
+
+    Value getValue() const;
+
+    std::string toString() const { return "<weak-box>"; }
+
+    size_t size() const { return sizeof(*this); }
+
+    // 弱い参照を f(key, value) の形で渡す。f が false を返したら参照を消す
+    template <typename F> void updateEntries(F& f)
+    {
+        Value none = Value::Nil;
+        if (!f(value_, none))
+            value_ = Value::False;
+    }
+
+private:
+    Value value_;
 };
 
 
+// キーが生きている間だけ値を生かしておく組。キーが回収されるとキーも値も #f になる
+class EphemeronObject : public TaggedObject {
+public:
+    static constexpr ObjectType kType = ObjectType::kEphemeron;
+
+    EphemeronObject(Value key, Value value)
+        : TaggedObject(kType)
+        , key_(key)
+        , value_(value)
+    {
+    }
+
+    Value getKey() const;
+
+    Value getValue() const;
+
+    std::string toString() const { return "<ephemeron>"; }
+
+    size_t size() const { return sizeof(*this); }
+
+    template <typename F> void updateEntries(F& f)
+    {
+        if (!f(key_, value_))
+            key_ = value_ = Value::False;
+    }
+
+private:
+    Value key_;
+    Value value_;
+};
+
+
+// キーを弱く持つハッシュ表。キーは eq? で比べ、各項目は ephemeron として扱う
+class WeakTableObject : public TaggedObject {
+public:
+    static constexpr ObjectType kType = ObjectType::kWeakTable;
+
+    WeakTableObject()
+        : TaggedObject(kType)
+    {
+        updateExternalSize();
+    }
+
+    Value get(Value key, Value default_value) const;
+
+    void set(Value key, Value value);
+
+    size_t getSize() const noexcept { return entries_.size(); }
+
+    std::string toString() const { return "<weak-table>"; }
+
+    size_t size() const { return sizeof(*this); }
+
+    // 並行マークのスレッドからも呼ばれるので、表には触れずに覚えておいた大きさを返す
+    size_t getExternalSize() const { return __atomic_load_n(&external_size_, __ATOMIC_RELAXED); }
+
+    // f が false を返した項目は消し、f がキーを書き換えた項目は入れ直す
+    template <typename F> void updateEntries(F& f)
+    {
+        std::vector<std::pair<Value, Value>> moved;
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            Value key = it->first;
+            if (!f(key, it->second)) {
+                it = entries_.erase(it);
+                continue;
+            }
+            if (key != it->first) {
+                moved.push_back(std::make_pair(key, it->second));
+                it = entries_.erase(it);
+                continue;
+            }
+            ++it;
+        }
+        entries_.insert(moved.begin(), moved.end());
+        updateExternalSize();
+    }
+
+private:
+    void updateExternalSize()
+    {
+        size_t size = entries_.bucket_count() * sizeof(void*)
+                      + entries_.size() * (sizeof(std::pair<Value, Value>) + 2 * sizeof(void*));
+        __atomic_store_n(&external_size_, size, __ATOMIC_RELAXED);
+    }
+
+    std::unordered_map<Value, Value> entries_;
+    size_t external_size_ = 0;
+};
+
+
+// 登録されたオブジェクトが到達できなくなったら、回収せずに取り出し待ちの列へ移す。
+// プログラムは好きな時に next() で取り出して、ファイルなどの後始末をする。
+class GuardianObject : public TaggedObject {
+public:
+    static constexpr ObjectType kType = ObjectType::kGuardian;
+
+    GuardianObject()
+        : TaggedObject(kType)
+    {
+    }
+
+    void add(Value obj);
+
+    // 到達できなくなったオブジェクトを一つ取り出す。なければ #f
+    Value next();
+
+    std::string toString() const { return "<guardian>"; }
+
+    size_t size() const { return sizeof(*this); }
+
+    // 並行マークのスレッドからも呼ばれるので、配列には触れずに覚えておいた大きさを返す
+    size_t getExternalSize() const { return __atomic_load_n(&external_size_, __ATOMIC_RELAXED); }
+
+    // 登録されたオブジェクトを f(Value&) に渡し、f が false を返したものを取り出し待ちにする
+    template <typename F> void updateRegistered(F& f)
+    {
+        auto it = registered_.begin();
+        for (Value& obj : registered_) {
+            if (f(obj))
+                *it++ = obj;
+            else
+                ready_.push_back(obj);
+        }
+        registered_.erase(it, registered_.end());
+        updateExternalSize();
+    }
+
+    // 取り出し待ちのオブジェクトは生きている。
+    // 並行マーク中にも変わるので visitReferences() では渡さず、GC が止まっている間に辿る。
+    template <typename F> void visitReady(F& f)
+    {
+        for (Value& obj : ready_)
+            f(obj);
+    }
+
+private:
+    void updateExternalSize()
+    {
+        size_t size = (registered_.capacity() + ready_.size()) * sizeof(Value);
+        __atomic_store_n(&external_size_, size, __ATOMIC_RELAXED);
+    }
+
+    std::vector<Value> registered_;
+    std::deque<Value> ready_;
+    size_t external_size_ = 0;
+};
+
+
+// 移動したオブジェクトの跡地に置かれ、移動先を指す
+class ForwardedObject : public TaggedObject {
+public:
+    static constexpr ObjectType kType = ObjectType::kForwarded;
+
+    ForwardedObject(Object* destination, size_t size)
+        : TaggedObject(kType)
+        , size_(static_cast<uint32_t>(size))
+        , destination_(destination)
+    {
+    }
+
+    Object* getDestination() const noexcept { return destination_; }
+
+    std::string toString() const { return "<forwarded>"; }
+
+    size_t size() const { return size_; }
+
+private:
+    uint32_t size_;
+    Object* destination_;
+};
+
+
+// obj が保持しているヒープへの参照それぞれについて f を呼ぶ。
+// f は Value& と Frame*& の両方を受け取れなければならない。Frame* は nullptr のこともある。
+template <typename F> void visitReferences(Object* obj, F& f)
+{
+    switch (obj->getType()) {
+    case ObjectType::kPair:
+        static_cast<PairObject*>(obj)->visitReferences(f);
+        break;
+    case ObjectType::kVector:
+        static_cast<VectorObject*>(obj)->visitReferences(f);
+        break;
+    case ObjectType::kFrame:
+        static_cast<Frame*>(obj)->visitReferences(f);
+        break;
+    case ObjectType::kClosure:
+        static_cast<ClosureObject*>(obj)->visitReferences(f);
+        break;
+    case ObjectType::kContinuation:
+        static_cast<ContinuationObject*>(obj)->visitReferences(f);
+        break;
+    case ObjectType::kString:
+    case ObjectType::kReal:
+    case ObjectType::kCFunction:
+    case ObjectType::kWeakBox:
+    case ObjectType::kEphemeron:
+    case ObjectType::kWeakTable:
+    case ObjectType::kGuardian:
+    case ObjectType::kForwarded:
+        break;
+    }
+}
+
+
+// 弱い参照を持つオブジェクトなら、その参照を obj->updateEntries(f) で渡す
+template <typename F> void updateEntries(Object* obj, F& f)
+{
+    switch (obj->getType()) {
+    case ObjectType::kWeakBox:
+        static_cast<WeakBoxObject*>(obj)->updateEntries(f);
+        break;
+    case ObjectType::kEphemeron:
+        static_cast<EphemeronObject*>(obj)->updateEntries(f);
+        break;
+    case ObjectType::kWeakTable:
+        static_cast<WeakTableObject*>(obj)->updateEntries(f);
+        break;
+    default:
+        break;
+    }
+}
+
+
 } // namespace nscheme
@@ -0,0 +1,138 @@
+#include "page.hpp"
+#include <cstring>
+#include <new>
+#include "object.hpp"
+#include "page_space.hpp"
+
+
+namespace nscheme {
+
+
+Page::Page(PageSpace* space, Allocator* owner, bool young, bool immortal, bool region,
+           bool pairs, size_t cell_size, size_t n_cells)
+    : space_(space)
+    , owner_(owner)
+    , young_(young)
+    , immortal_(immortal)
+    , region_(region)
+    , pairs_(pairs)
+    , cell_size_(cell_size)
+    , n_cells_(n_cells)
+{
+    std::memset(allocated_, 0, sizeof(allocated_));
+    std::memset(marked_, 0, sizeof(marked_));
+    std::memset(remembered_, 0, sizeof(remembered_));
+    std::memset(forwarded_, 0, sizeof(forwarded_));
+}
+
+
+Page* Page::create(PageSpace* space, Allocator* owner, size_t cell_size, bool pairs)
+{
+    size_t n_cells = (kSize - headerSize()) / cell_size;
+    if (n_cells == 0) {
+        void* memory = space->allocateLarge(largeSize(cell_size));
+        return new (memory) Page(space, owner, false, false, false, false, cell_size, 1);
+    }
+    return new (space->allocatePage())
+        Page(space, owner, false, false, false, pairs, cell_size, n_cells);
+}
+
+
+// ペアのページでは移動先を記録できるよう、セルの大きさをペアの大きさにしておく
+Page* Page::createYoung(PageSpace* space, Allocator* owner, bool pairs)
+{
+    return new (space->allocatePage())
+        Page(space, owner, true, false, false, pairs, pairs ? kCellAlign : 0, 0);
+}
+
+
+// 書き込みバリアが記憶集合のビットを引けるよう、セルの大きさを最小のものにしておく
+Page* Page::createImmortal(PageSpace* space, Allocator* owner, bool pairs)
+{
+    return new (space->allocatePage())
+        Page(space, owner, false, true, false, pairs, kCellAlign, 0);
+}
+
+
+Page* Page::createRegion(PageSpace* space, Allocator* owner, bool pairs)
+{
+    return new (space->allocatePage()) Page(space, owner, false, true, true, pairs, kCellAlign, 0);
+}
+
+
+// ペアは壊す必要がないので、ペアのページは中身を見ずに返す
+void Page::destroy(Page* page)
+{
+    if (!page->pairs_)
+        page->clear();
+    PageSpace* space = page->space_;
+    size_t cell_size = page->cell_size_;
+    page->~Page();
+    if (headerSize() + cell_size > kSize)
+        space->freeLarge(page, largeSize(cell_size));
+    else
+        space->freePage(page);
+}
+
+
+size_t Page::sizeOf(const Object* obj) { return obj->size(); }
+
+
+void Page::freeCell(size_t index, Reclaimer* reclaimer)
+{
+    objectAt(index)->destroy(reclaimer);
+    allocated_[index / 64] &= ~(uint64_t(1) << (index % 64));
+    remembered_[index / 64] &= ~(uint64_t(1) << (index % 64));
+    n_live_--;
+}
+
+
+size_t Page::countMarked() const
+{
+    size_t n = 0;
+    for (uint64_t word : marked_)
+        n += __builtin_popcountll(word);
+    return n;
+}
+
+
+size_t Page::sweep(Reclaimer* reclaimer)
+{
+    size_t freed = 0;
+    free_list_ = nullptr;
+
+    // 後ろから走査して、フリーリストをアドレス順に並べる
+    for (size_t i = n_bumped_; i-- > 0;) {
+        if (isAllocated(i)) {
+            if (isMarked(i))
+                continue;
+            freed += objectAt(i)->getTotalSize();
+            freeCell(i, reclaimer);
+        }
+        FreeCell* cell = reinterpret_cast<FreeCell*>(cellAt(i));
+        cell->next = free_list_;
+        free_list_ = cell;
+    }
+    std::memset(marked_, 0, sizeof(marked_));
+    return freed;
+}
+
+
+void Page::clear(Reclaimer* reclaimer)
+{
+    if (young_ || immortal_) {
+        forEachObject([reclaimer](Object* obj) { obj->destroy(reclaimer); });
+        std::memset(forwarded_, 0, sizeof(forwarded_));
+        used_ = 0;
+        return;
+    }
+    for (size_t i = 0; i < n_bumped_; ++i) {
+        if (isAllocated(i))
+            freeCell(i, reclaimer);
+    }
+    free_list_ = nullptr;
+    n_bumped_ = 0;
+}
+
+
+} // namespace nscheme
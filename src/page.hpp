@@ -0,0 +1,244 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+
+namespace nscheme {
+
+class Allocator;
+class Object;
+class PageSpace;
+class Reclaimer;
+
+
+// 同じサイズのセルだけを詰め込んだヒープのページ。
+// kSize 境界にアラインされているので、オブジェクトのアドレスから所属するページを引ける。
+// 若い世代と不死とリージョンのページだけは例外で、大きさの異なるオブジェクトを先頭から詰めていく。
+// ペアはヘッダを持たないので、世代を問わずペアだけを置くページに分けて、型をページから引く。
+// マークビットはオブジェクトではなくページのビットマップに持ち、sweep の度に消す。
+// ページのメモリは PageSpace から確保し、破棄したらそこへ返す。
+class Page {
+public:
+    static constexpr size_t kSize = 64 * 1024;
+    static constexpr size_t kCellAlign = 16;
+    static constexpr size_t kMaxCells = kSize / kCellAlign;
+
+    // cell_size が大きすぎて一つも入らない場合は、そのオブジェクト専用の大きなページを作る
+    static Page* create(PageSpace* space, Allocator* owner, size_t cell_size, bool pairs);
+
+    static Page* createYoung(PageSpace* space, Allocator* owner, bool pairs);
+
+    // 回収しないオブジェクトのページ
+    static Page* createImmortal(PageSpace* space, Allocator* owner, bool pairs);
+
+    // リージョンのページ。リージョンを抜けるまでは不死のページと同じに扱う
+    static Page* createRegion(PageSpace* space, Allocator* owner, bool pairs);
+
+    static void destroy(Page* page);
+
+    static Page* of(const void* ptr)
+    {
+        return reinterpret_cast<Page*>(reinterpret_cast<uintptr_t>(ptr) & ~(kSize - 1));
+    }
+
+    Allocator* getOwner() const noexcept { return owner_; }
+
+    bool isYoung() const noexcept { return young_; }
+
+    bool isImmortal() const noexcept { return immortal_; }
+
+    bool isRegion() const noexcept { return region_; }
+
+    // 古い世代のマークと sweep の対象かどうか
+    bool isOld() const noexcept { return !young_ && !immortal_; }
+
+    bool holdsPairs() const noexcept { return pairs_; }
+
+    size_t getCellSize() const noexcept { return cell_size_; }
+
+    size_t getLiveCount() const noexcept { return n_live_; }
+
+    size_t getCapacity() const noexcept { return n_cells_; }
+
+    bool isFull() const noexcept { return free_list_ == nullptr && n_bumped_ == n_cells_; }
+
+    // 空きセルを返す。空きがなければ nullptr
+    void* allocate()
+    {
+        if (free_list_ != nullptr) {
+            FreeCell* cell = free_list_;
+            free_list_ = cell->next;
+            return cell;
+        }
+        if (n_bumped_ < n_cells_)
+            return cellAt(n_bumped_++);
+        return nullptr;
+    }
+
+    // 若い世代と不死とリージョンのページで、空いているところの先頭から割り当てる
+    void* allocateYoung(size_t size)
+    {
+        size = (size + kCellAlign - 1) / kCellAlign * kCellAlign;
+        if (used_ + size > kSize - headerSize())
+            return nullptr;
+        void* ptr = reinterpret_cast<char*>(this) + headerSize() + used_;
+        used_ += size;
+        return ptr;
+    }
+
+    // allocate() したセル上にオブジェクトの構築が完了したことを記録する
+    void commit(const void* cell)
+    {
+        size_t index = indexOf(cell);
+        allocated_[index / 64] |= uint64_t(1) << (index % 64);
+        n_live_++;
+    }
+
+    // マークスレッドとインタプリタの両方から触られるので、マークビットは不可分に読み書きする
+    bool isMarked(const void* cell) const { return isMarked(indexOf(cell)); }
+
+    void setMark(const void* cell) { tryMark(cell); }
+
+    // 自分がマークした時だけ true を返す
+    bool tryMark(const void* cell)
+    {
+        size_t index = indexOf(cell);
+        uint64_t bit = uint64_t(1) << (index % 64);
+        return !(__atomic_fetch_or(&marked_[index / 64], bit, __ATOMIC_RELAXED) & bit);
+    }
+
+    size_t countMarked() const;
+
+    // 若い世代を指しているとして記憶集合に入れたかどうか。古い世代のページでだけ使う
+    bool isRemembered(const void* cell) const
+    {
+        size_t index = indexOf(cell);
+        return (remembered_[index / 64] >> (index % 64)) & 1;
+    }
+
+    void setRemembered(const void* cell, bool remembered)
+    {
+        size_t index = indexOf(cell);
+        uint64_t bit = uint64_t(1) << (index % 64);
+        remembered_[index / 64] = remembered ? remembered_[index / 64] | bit
+                                             : remembered_[index / 64] & ~bit;
+    }
+
+    // ペアのセルには ForwardedObject を置けないので、移動したことはビットマップに記録し、
+    // 移動先をセルの先頭に書く。移動していなければ nullptr を返す
+    Object* getForwardingAddress(const void* cell) const
+    {
+        size_t index = indexOf(cell);
+        if (!((forwarded_[index / 64] >> (index % 64)) & 1))
+            return nullptr;
+        return *static_cast<Object* const*>(cell);
+    }
+
+    void setForwardingAddress(void* cell, Object* destination)
+    {
+        size_t index = indexOf(cell);
+        forwarded_[index / 64] |= uint64_t(1) << (index % 64);
+        *static_cast<Object**>(cell) = destination;
+    }
+
+    template <typename F> void forEachObject(F f)
+    {
+        if (young_ || immortal_) {
+            for (size_t offset = 0; offset < used_;) {
+                Object* obj = reinterpret_cast<Object*>(reinterpret_cast<char*>(this)
+                                                        + headerSize() + offset);
+                offset += (sizeOf(obj) + kCellAlign - 1) / kCellAlign * kCellAlign;
+                f(obj);
+            }
+            return;
+        }
+        for (size_t i = 0; i < n_bumped_; ++i) {
+            if (isAllocated(i))
+                f(objectAt(i));
+        }
+    }
+
+    // マークされていないオブジェクトを破棄してフリーリストを作り直し、マークビットを消す。
+    // 解放したバイト数を返す
+    size_t sweep(Reclaimer* reclaimer = nullptr);
+
+    // 残っているオブジェクトをすべて破棄する
+    void clear(Reclaimer* reclaimer = nullptr);
+
+    // 若いページやリージョンのページを空にする。オブジェクトは破棄済みでなければならない
+    void resetYoung()
+    {
+        used_ = 0;
+        std::memset(forwarded_, 0, sizeof(forwarded_));
+    }
+
+private:
+    struct FreeCell {
+        FreeCell* next;
+    };
+
+    Page(PageSpace* space, Allocator* owner, bool young, bool immortal, bool region, bool pairs,
+         size_t cell_size, size_t n_cells);
+
+    static size_t sizeOf(const Object* obj);
+
+    static size_t headerSize();
+
+    static size_t largeSize(size_t cell_size)
+    {
+        return (headerSize() + cell_size + kSize - 1) / kSize * kSize;
+    }
+
+    char* cellAt(size_t index)
+    {
+        return reinterpret_cast<char*>(this) + headerSize() + index * cell_size_;
+    }
+
+    Object* objectAt(size_t index) { return reinterpret_cast<Object*>(cellAt(index)); }
+
+    size_t indexOf(const void* cell) const
+    {
+        return (static_cast<const char*>(cell) - reinterpret_cast<const char*>(this) - headerSize())
+               / cell_size_;
+    }
+
+    bool isAllocated(size_t index) const
+    {
+        return (allocated_[index / 64] >> (index % 64)) & 1;
+    }
+
+    bool isMarked(size_t index) const
+    {
+        return (__atomic_load_n(&marked_[index / 64], __ATOMIC_RELAXED) >> (index % 64)) & 1;
+    }
+
+    void freeCell(size_t index, Reclaimer* reclaimer);
+
+    PageSpace* space_;
+    Allocator* owner_;
+    bool young_;
+    bool immortal_;
+    bool region_;
+    bool pairs_;
+    size_t used_ = 0;
+    size_t cell_size_;
+    size_t n_cells_;
+    size_t n_bumped_ = 0;
+    size_t n_live_ = 0;
+    FreeCell* free_list_ = nullptr;
+    uint64_t allocated_[kMaxCells / 64];
+    uint64_t marked_[kMaxCells / 64];
+    uint64_t remembered_[kMaxCells / 64];
+    uint64_t forwarded_[kMaxCells / 64];
+};
+
+
+inline size_t Page::headerSize()
+{
+    return (sizeof(Page) + kCellAlign - 1) / kCellAlign * kCellAlign;
+}
+
+
+} // namespace nscheme
@@ -0,0 +1,205 @@
+#include "page_space.hpp"
+#include <sys/mman.h>
+#include <new>
+#include "large_space.hpp"
+
+
+namespace nscheme {
+
+
+constexpr size_t PageSpace::kRegionSize;
+constexpr size_t PageSpace::kPagesPerRegion;
+constexpr uint64_t PageSpace::kAllPages;
+#ifdef NSCHEME_COMPRESSED_REFS
+constexpr size_t PageSpace::kReservedSize;
+constexpr size_t PageSpace::kMinReservedSize;
+#endif
+
+
+PageSpace::~PageSpace()
+{
+#ifdef NSCHEME_COMPRESSED_REFS
+    if (reserved_ != 0)
+        unmapLargeSpace(reinterpret_cast<void*>(reserved_), reserved_size_);
+#else
+    for (auto& entry : regions_)
+        unmapLargeSpace(reinterpret_cast<void*>(entry.first), kRegionSize);
+#endif
+}
+
+
+void PageSpace::setHugePages(bool enabled)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    huge_pages_ = enabled;
+#ifdef MADV_HUGEPAGE
+    // 既にある領域も、後で huge page にまとめてもらう
+    if (enabled) {
+        for (auto& entry : regions_)
+            madvise(reinterpret_cast<void*>(entry.first), kRegionSize, MADV_HUGEPAGE);
+    }
+#endif
+}
+
+
+// 領域一つ分のアドレス空間を予約して返す。mutex_ を取ってから呼ぶ
+void* PageSpace::reserveRegion()
+{
+#ifdef NSCHEME_COMPRESSED_REFS
+    // 最初に大きな予約を取り、以後はそこから切り出す
+    for (size_t size = kReservedSize; reserved_ == 0 && size >= kMinReservedSize; size /= 2) {
+        try {
+            reserved_ = reinterpret_cast<uintptr_t>(reserveLargeSpace(size, kRegionSize));
+            reserved_size_ = size;
+        }
+        catch (std::bad_alloc&) {
+        }
+    }
+    if (reserved_ == 0)
+        throw std::bad_alloc();
+    if (!unused_regions_.empty()) {
+        uintptr_t base = unused_regions_.back();
+        unused_regions_.pop_back();
+        return reinterpret_cast<void*>(base);
+    }
+    if ((n_carved_ + 1) * kRegionSize > reserved_size_)
+        throw std::bad_alloc();
+    return reinterpret_cast<void*>(reserved_ + n_carved_++ * kRegionSize);
+#else
+    return reserveLargeSpace(kRegionSize, kRegionSize);
+#endif
+}
+
+
+// 領域を一つ予約して読み書きできるようにする。mutex_ を取ってから呼ぶ
+void* PageSpace::mapRegion()
+{
+    void* memory = reserveRegion();
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+#ifdef MAP_HUGETLB
+    // transparent huge page が使えなければ、予約された huge page から確保する。
+    // huge page が足りなければ予約を置き換える前に失敗するので、そのまま普通に確保し直せる
+    if (huge_pages_ && !transparent_
+        && mmap(memory, kRegionSize, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0)
+               != MAP_FAILED)
+        return memory;
+#endif
+    if (mmap(memory, kRegionSize, PROT_READ | PROT_WRITE, flags, -1, 0) == MAP_FAILED) {
+        unmapRegion(reinterpret_cast<uintptr_t>(memory));
+        throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    // transparent huge page のないカーネルでは失敗するので、以後は MAP_HUGETLB を使う
+    if (huge_pages_ && transparent_ && madvise(memory, kRegionSize, MADV_HUGEPAGE) != 0)
+        transparent_ = false;
+#endif
+    return memory;
+}
+
+
+// 領域を OS に返す。予約から切り出した領域は予約だけの状態に戻す。mutex_ を取ってから呼ぶ
+void PageSpace::unmapRegion(uintptr_t base)
+{
+#ifdef NSCHEME_COMPRESSED_REFS
+    mmap(reinterpret_cast<void*>(base), kRegionSize, PROT_NONE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+    unused_regions_.push_back(base);
+#else
+    unmapLargeSpace(reinterpret_cast<void*>(base), kRegionSize);
+#endif
+}
+
+
+void* PageSpace::allocatePage()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& entry : regions_) {
+        Region& region = entry.second;
+        if (region.free == 0)
+            continue;
+        size_t index = __builtin_ctzll(region.free);
+        uint64_t bit = uint64_t(1) << index;
+        region.free &= ~bit;
+        if (region.decommitted & bit) {
+            // 中身を捨てたページは触れた時に OS が 0 で埋めたものを割り当て直す
+            region.decommitted &= ~bit;
+            committed_size_ += Page::kSize;
+        }
+        return reinterpret_cast<void*>(entry.first + index * Page::kSize);
+    }
+
+    void* memory = mapRegion();
+    regions_[reinterpret_cast<uintptr_t>(memory)].free = kAllPages & ~uint64_t(1);
+    committed_size_ += kRegionSize;
+    return memory;
+}
+
+
+void PageSpace::freePage(void* page)
+{
+    uintptr_t address = reinterpret_cast<uintptr_t>(page);
+    uintptr_t base = address & ~(kRegionSize - 1);
+    std::lock_guard<std::mutex> lock(mutex_);
+    regions_[base].free |= uint64_t(1) << ((address - base) / Page::kSize);
+}
+
+
+void* PageSpace::allocateLarge(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    // huge page より大きければ、その境界に合わせて huge page を使わせる
+    bool huge = huge_pages_ && bytes >= kRegionSize;
+    void* memory = mapLargeSpace(bytes, huge ? kRegionSize : Page::kSize);
+#ifdef MADV_HUGEPAGE
+    if (huge)
+        madvise(memory, bytes / kRegionSize * kRegionSize, MADV_HUGEPAGE);
+#endif
+    committed_size_ += bytes;
+    return memory;
+}
+
+
+void PageSpace::freeLarge(void* page, size_t bytes)
+{
+    unmapLargeSpace(page, bytes);
+    std::lock_guard<std::mutex> lock(mutex_);
+    committed_size_ -= bytes;
+}
+
+
+void PageSpace::trim()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = regions_.begin(); it != regions_.end();) {
+        Region& region = it->second;
+        size_t n_decommitted = __builtin_popcountll(region.decommitted);
+        if (region.free == kAllPages) {
+            unmapRegion(it->first);
+            committed_size_ -= kRegionSize - n_decommitted * Page::kSize;
+            it = regions_.erase(it);
+            continue;
+        }
+        if (huge_pages_) {
+            ++it;
+            continue;
+        }
+        for (uint64_t rest = region.free & ~region.decommitted; rest != 0; rest &= rest - 1) {
+            size_t index = __builtin_ctzll(rest);
+            madvise(reinterpret_cast<void*>(it->first + index * Page::kSize), Page::kSize,
+                    MADV_DONTNEED);
+            committed_size_ -= Page::kSize;
+        }
+        region.decommitted = region.free;
+        ++it;
+    }
+}
+
+
+size_t PageSpace::getCommittedSize()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return committed_size_;
+}
+
+
+} // namespace nscheme
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+#include "page.hpp"
+
+
+namespace nscheme {
+
+
+// ヒープのページを OS から確保して配る。
+// 普通のページは kRegionSize の領域からまとめて切り出し、返されたページは trim() で OS に返す。
+// NSCHEME_COMPRESSED_REFS を定義した時は、領域をすべて最初に予約した kReservedSize の
+// アドレス空間から切り出し、ページ同士の距離が CompressedRef に収まるようにする。
+// 領域のページがすべて返されていれば領域ごと unmap し、そうでなければ中身だけを捨てる。
+// 領域の大きさは x86-64 の huge page に合わせてあり、setHugePages() で huge page を使わせられる。
+// ページはバックグラウンドのスレッドからも返されるので、mutex で保護する。
+class PageSpace {
+public:
+    static constexpr size_t kRegionSize = 2 * 1024 * 1024;
+    static constexpr size_t kPagesPerRegion = kRegionSize / Page::kSize;
+#ifdef NSCHEME_COMPRESSED_REFS
+    static constexpr size_t kReservedSize = size_t(32) * 1024 * 1024 * 1024;
+#endif
+
+    PageSpace() = default;
+
+    PageSpace(const PageSpace&) = delete;
+
+    PageSpace& operator=(const PageSpace&) = delete;
+
+    ~PageSpace();
+
+    // 領域を huge page で確保する。transparent huge page を使えなければ MAP_HUGETLB を試す。
+    // huge page を分割させないよう、trim() はすべてのページが空いた領域だけを返すようになる
+    void setHugePages(bool enabled);
+
+    // Page::kSize の大きさで、その境界に合ったページを返す
+    void* allocatePage();
+
+    void freePage(void* page);
+
+    // 一つのオブジェクト専用の大きなページは OS から直接確保し、返されたらすぐに unmap する
+    void* allocateLarge(size_t bytes);
+
+    void freeLarge(void* page, size_t bytes);
+
+    // 空いているページの物理メモリを OS に返す
+    void trim();
+
+    // 中身を捨てていない、物理メモリを使いうるバイト数
+    size_t getCommittedSize();
+
+private:
+    static_assert(kPagesPerRegion < 64, "too many pages in a region");
+
+    static constexpr uint64_t kAllPages = (uint64_t(1) << kPagesPerRegion) - 1;
+
+#ifdef NSCHEME_COMPRESSED_REFS
+    // 仮想アドレス空間が制限されていれば、この大きさまでは予約を縮めて試す
+    static constexpr size_t kMinReservedSize = 64 * 1024 * 1024;
+#endif
+
+    // ビット i が領域の i 番目のページを表す
+    struct Region {
+        uint64_t free = 0;
+        uint64_t decommitted = 0; // 空いていて、中身を OS に返したページ
+    };
+
+    void* reserveRegion();
+    void* mapRegion();
+    void unmapRegion(uintptr_t base);
+
+    std::mutex mutex_;
+#ifdef NSCHEME_COMPRESSED_REFS
+    uintptr_t reserved_ = 0;
+    size_t reserved_size_ = 0;
+    size_t n_carved_ = 0;                   // 予約の先頭から切り出した領域の数
+    std::vector<uintptr_t> unused_regions_; // 切り出した後で予約だけの状態に戻した領域
+#endif
+    bool huge_pages_ = false;
+    bool transparent_ = true; // madvise(MADV_HUGEPAGE) が使えるかどうか
+    std::map<uintptr_t, Region> regions_; // 低いアドレスから使う
+    size_t committed_size_ = 0;
+};
+
+
+} // namespace nscheme
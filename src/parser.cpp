@@ -18,13 +18,13 @@ bool isSelfEvaluating(Value value)
     if (value == Value::False)
         return true;
     if (value.isPointer()) {
-        auto p1 = dynamic_cast<StringObject*>(value.asPointer());
+        auto p1 = objectCast<StringObject>(value.asPointer());
         if (p1 != nullptr)
             return true;
-        auto p2 = dynamic_cast<RealObject*>(value.asPointer());
+        auto p2 = objectCast<RealObject>(value.asPointer());
         if (p2 != nullptr)
             return true;
-        auto p3 = dynamic_cast<VectorObject*>(value.asPointer());
+        auto p3 = objectCast<VectorObject>(value.asPointer());
         if (p3 != nullptr)
             return true;
     }
@@ -36,7 +36,7 @@ inline bool isPair(Value value)
 {
     if (!value.isPointer())
         return false;
-    return dynamic_cast<PairObject*>(value.asPointer());
+    return objectCast<PairObject>(value.asPointer());
 }
 
 
@@ -121,7 +121,7 @@ std::unique_ptr<ExprNode> Parser::parseExpr(Value value, const Position& positio
 
     if (!value.isPointer())
         throw ParseError(position, "invalid expression");
-    PairObject* p = dynamic_cast<PairObject*>(value.asPointer());
+    PairObject* p = objectCast<PairObject>(value.asPointer());
     if (p == nullptr)
         throw ParseError(position, "invalid expression");
 
@@ -28,7 +28,7 @@ Value Reader::readDatum()
         return value;
 
     case TokenType::kReal:
-        value = Value::fromPointer(allocator_->make<RealObject>(token_.getReal()));
+        value = Value::fromPointer(allocator_->makeImmortal<RealObject>(token_.getReal()));
         token_ = scanner_->getToken();
         return value;
 
@@ -38,7 +38,8 @@ Value Reader::readDatum()
         return value;
 
     case TokenType::kString:
-        value = Value::fromPointer(allocator_->make<StringObject>(token_.getString()));
+        value
+            = Value::fromPointer(allocator_->makeImmortal<StringObject>(token_.getString()));
         token_ = scanner_->getToken();
         return value;
 
@@ -74,7 +75,7 @@ Value Reader::readList()
     while (token_.getType() != TokenType::kEof && token_.getType() != TokenType::kCloseParen) {
         if (first == nullptr) {
             Position pos = token_.getPosition();
-            first = last = allocator_->make<PairObject>(readDatum(), Value::Nil);
+            first = last = allocator_->makeImmortal<PairObject>(readDatum(), Value::Nil);
             source_map_->insert(std::make_pair(last, pos));
         }
         else if (token_.getType() == TokenType::kPeriod) {
@@ -86,7 +87,7 @@ Value Reader::readList()
         }
         else {
             Position pos = token_.getPosition();
-            PairObject* p = allocator_->make<PairObject>(readDatum(), Value::Nil);
+            PairObject* p = allocator_->makeImmortal<PairObject>(readDatum(), Value::Nil);
             last->setCdr(Value::fromPointer(p));
             last = p;
             source_map_->insert(std::make_pair(last, pos));
@@ -103,7 +104,7 @@ Value Reader::readVector()
 {
     Position position = token_.getPosition();
     token_ = scanner_->getToken();
-    VectorObject* obj = allocator_->make<VectorObject>();
+    VectorObject* obj = allocator_->makeImmortal<VectorObject>();
     while (token_.getType() != TokenType::kEof && token_.getType() != TokenType::kCloseParen) {
         obj->add(readDatum());
     }
@@ -139,9 +140,9 @@ Value Reader::readAbbr()
     Symbol symbol = symbol_table_->intern(name);
     token_ = scanner_->getToken();
     Value v = readDatum();
-    PairObject* p1 = allocator_->make<PairObject>(v, Value::Nil);
-    PairObject* p2
-        = allocator_->make<PairObject>(Value::fromSymbol(symbol), Value::fromPointer(p1));
+    PairObject* p1 = allocator_->makeImmortal<PairObject>(v, Value::Nil);
+    PairObject* p2 = allocator_->makeImmortal<PairObject>(Value::fromSymbol(symbol),
+                                                          Value::fromPointer(p1));
     source_map_->insert(std::make_pair(p1, position));
     source_map_->insert(std::make_pair(p2, position));
     return Value::fromPointer(p2);
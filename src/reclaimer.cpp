@@ -0,0 +1,71 @@
+#include "reclaimer.hpp"
+#include "page.hpp"
+
+
+namespace nscheme {
+
+
+constexpr size_t Reclaimer::kMinExternalSize;
+
+
+Reclaimer::Reclaimer()
+    : thread_(&Reclaimer::run, this)
+{
+}
+
+
+Reclaimer::~Reclaimer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        cond_.notify_one();
+    }
+    thread_.join();
+}
+
+
+void Reclaimer::destroyLater(Page* page)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    pages_.push_back(page);
+    cond_.notify_one();
+}
+
+
+void Reclaimer::flush()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_cond_.wait(lock, [this] { return !busy_ && garbage_.empty() && pages_.empty(); });
+}
+
+
+void Reclaimer::run()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        if (garbage_.empty() && pages_.empty()) {
+            if (stop_)
+                return;
+            idle_cond_.notify_all();
+            cond_.wait(lock, [this] { return stop_ || !garbage_.empty() || !pages_.empty(); });
+            continue;
+        }
+
+        std::vector<Garbage*> garbage;
+        std::vector<Page*> pages;
+        garbage.swap(garbage_);
+        pages.swap(pages_);
+        busy_ = true;
+        lock.unlock();
+        for (Garbage* g : garbage)
+            delete g;
+        for (Page* page : pages)
+            Page::destroy(page);
+        lock.lock();
+        busy_ = false;
+    }
+}
+
+
+} // namespace nscheme
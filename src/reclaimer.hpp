@@ -0,0 +1,76 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+namespace nscheme {
+
+class Page;
+
+
+// 死んだオブジェクトのデストラクタと、空になったページの解放をバックグラウンドで行うスレッド。
+// 大きなベクタや継続が死んだ時に、配列の解放で GC の停止時間が延びないようにする。
+class Reclaimer {
+public:
+    // オブジェクトの外の配列などがこれより小さければ、その場で壊した方が安い
+    static constexpr size_t kMinExternalSize = 16 * 1024;
+
+    Reclaimer();
+
+    Reclaimer(const Reclaimer&) = delete;
+
+    Reclaimer& operator=(const Reclaimer&) = delete;
+
+    // 引き受けたものをすべて解放してからスレッドを止める
+    ~Reclaimer();
+
+    // obj の中身を別の場所に移してから obj を壊す。中身はスレッドが後で壊す
+    template <typename T> void destroyLater(T* obj)
+    {
+        Garbage* garbage = new GarbageOf<T>(std::move(*obj));
+        obj->~T();
+        std::lock_guard<std::mutex> lock(mutex_);
+        garbage_.push_back(garbage);
+        cond_.notify_one();
+    }
+
+    // page をスレッドが後で Page::destroy() する
+    void destroyLater(Page* page);
+
+    // それまでに引き受けたものをすべて解放し終えるまで待つ
+    void flush();
+
+private:
+    struct Garbage {
+        virtual ~Garbage() = default;
+    };
+
+    template <typename T> struct GarbageOf : Garbage {
+        explicit GarbageOf(T&& obj)
+            : obj(std::move(obj))
+        {
+        }
+
+        T obj;
+    };
+
+    void run();
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::condition_variable idle_cond_;
+    std::vector<Garbage*> garbage_;
+    std::vector<Page*> pages_;
+    bool busy_ = false;
+    bool stop_ = false;
+    // 他のメンバを初期化してから動かす
+    std::thread thread_;
+};
+
+
+} // namespace nscheme
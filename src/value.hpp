@@ -32,6 +32,16 @@ public:
 
     static Value fromBoolean(bool b) { return b ? Value::True : Value::False; }
 
+    // GC のマークスレッドが並行して読むかもしれないスロットへの読み書き
+    static Value load(const Value& slot)
+    {
+        Value v(kNil);
+        __atomic_load(&slot, &v, __ATOMIC_ACQUIRE);
+        return v;
+    }
+
+    static void store(Value& slot, Value v) { __atomic_store(&slot, &v, __ATOMIC_RELEASE); }
+
     bool isPointer() const { return (value_ & kMask) == 0 & value_ > kUndefined; }
 
     bool isInteger() const { return (value_ & kMask) == kFlagInteger; }
@@ -61,6 +71,9 @@ public:
 
     bool operator!=(const Value& rhs) const noexcept { return value_ != rhs.value_; }
 
+    // eq? で等しいものが等しいハッシュ値を持つ
+    size_t hash() const noexcept { return std::hash<uint64_t>()(value_); }
+
 private:
     explicit Value(uint64_t value)
         : value_(value)
@@ -90,3 +103,14 @@ private:
 
 
 } // namespace nscheme
+
+
+namespace std {
+
+
+template <> struct hash<nscheme::Value> : public std::unary_function<nscheme::Value, size_t> {
+    size_t operator()(const nscheme::Value& value) const { return value.hash(); }
+};
+
+
+} // namespace std
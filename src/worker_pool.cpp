@@ -0,0 +1,74 @@
+#include "worker_pool.hpp"
+#include <algorithm>
+
+
+namespace nscheme {
+
+
+void WorkerPool::setThreads(size_t n_threads)
+{
+    stopThreads();
+    stop_ = false;
+    for (size_t i = 1; i < n_threads; ++i)
+        threads_.emplace_back(&WorkerPool::work, this, i, generation_);
+}
+
+
+void WorkerPool::run(size_t n_threads, const std::function<void(size_t)>& f)
+{
+    n_threads = std::min(n_threads, getThreads());
+    if (n_threads <= 1) {
+        f(0);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        task_ = &f;
+        n_tasks_ = n_threads;
+        n_pending_ = n_threads - 1;
+        generation_++;
+        cond_.notify_all();
+    }
+    f(0);
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cond_.wait(lock, [this] { return n_pending_ == 0; });
+    task_ = nullptr;
+}
+
+
+void WorkerPool::stopThreads()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        cond_.notify_all();
+    }
+    for (std::thread& thread : threads_)
+        thread.join();
+    threads_.clear();
+}
+
+
+// 0 番以外のスレッドの本体。run() が渡した仕事に自分の番号が含まれていれば実行する。
+// 起きる前に渡された仕事を見逃さないよう、起こした時点の世代を受け取る
+void WorkerPool::work(size_t id, size_t seen)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        cond_.wait(lock, [this, seen] { return stop_ || generation_ != seen; });
+        if (stop_)
+            return;
+        seen = generation_;
+        if (id >= n_tasks_)
+            continue;
+        const std::function<void(size_t)>* task = task_;
+        lock.unlock();
+        (*task)(id);
+        lock.lock();
+        if (--n_pending_ == 0)
+            done_cond_.notify_one();
+    }
+}
+
+
+} // namespace nscheme
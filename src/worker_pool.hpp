@@ -0,0 +1,53 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace nscheme {
+
+
+// GC の仕事を複数のスレッドで分担するためのスレッドの組。
+// GC のたびにスレッドを作ると小さなヒープでは停止時間の大半がその待ちになるので、
+// スレッドは setThreads() で起こしておき、壊す時まで使い回す。
+class WorkerPool {
+public:
+    WorkerPool() = default;
+
+    WorkerPool(const WorkerPool&) = delete;
+
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    ~WorkerPool() { stopThreads(); }
+
+    // 呼んだスレッドと合わせて n_threads 個のスレッドで仕事をするようにする
+    void setThreads(size_t n_threads);
+
+    size_t getThreads() const noexcept { return threads_.size() + 1; }
+
+    // 0 番は呼んだスレッドで、残りはプールのスレッドで f(i) を呼び、すべて終わるのを待つ。
+    // n_threads は getThreads() までに抑える
+    void run(size_t n_threads, const std::function<void(size_t)>& f);
+
+private:
+    void stopThreads();
+
+    void work(size_t id, size_t seen);
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::condition_variable done_cond_;
+    const std::function<void(size_t)>* task_ = nullptr;
+    size_t n_tasks_ = 0;
+    size_t n_pending_ = 0;
+    size_t generation_ = 0;
+    bool stop_ = false;
+    std::vector<std::thread> threads_;
+};
+
+
+} // namespace nscheme
@@ -0,0 +1,822 @@
+#include "allocator.hpp"
+#include "context.hpp"
+#include "heap_dump.hpp"
+#include "page_space.hpp"
+#include "symbol_table.hpp"
+#include "gtest/gtest.h"
+#include <set>
+using namespace nscheme;
+
+namespace {
+
+size_t countPages(Value list)
+{
+    std::set<Page*> pages;
+    for (Value v = list; v != Value::Nil; v = static_cast<PairObject*>(v.asPointer())->getCdr())
+        pages.insert(Page::of(v.asPointer()));
+    return pages.size();
+}
+
+int64_t sumList(Value list)
+{
+    int64_t sum = 0;
+    for (Value v = list; v != Value::Nil;) {
+        PairObject* p = static_cast<PairObject*>(v.asPointer());
+        sum += p->getCar().asInteger();
+        v = p->getCdr();
+    }
+    return sum;
+}
+
+} // namespace
+
+TEST(AllocatorTest, KeepsReachableObjects)
+{
+    Allocator allocator;
+    allocator.setInitialLimit(1024);
+    Context ctx;
+    ctx.allocator = &allocator;
+
+    ctx.value_stack.push_back(Value::Nil);
+    for (int i = 0; i < 100000; ++i) {
+        Value list = ctx.value_stack.back();
+        ctx.value_stack.back()
+            = Value::fromPointer(allocator.make<PairObject>(Value::fromInteger(i), list));
+        allocator.make<PairObject>(Value::fromInteger(i), Value::Nil); // garbage
+        if (allocator.needGc())
+            allocator.gc(&ctx);
+    }
+    allocator.gc(&ctx);
+
+    EXPECT_EQ(int64_t(100000) * 99999 / 2, sumList(ctx.value_stack.back()));
+}
+
+TEST(AllocatorTest, RemembersOldToYoungReferences)
+{
+    Allocator allocator;
+    Context ctx;
+    ctx.allocator = &allocator;
+
+    PairObject* old = allocator.makeTenured<PairObject>(Value::fromInteger(1), Value::Nil);
+    ctx.value_stack.push_back(Value::fromPointer(old));
+
+    PairObject* young = allocator.make<PairObject>(Value::fromInteger(2), Value::Nil);
+    old->setCdr(Value::fromPointer(young));
+    allocator.gc(&ctx);
+
+    EXPECT_NE(Value::fromPointer(young), old->getCdr());
+    EXPECT_EQ(3, sumList(ctx.value_stack.back()));
+}
+
+TEST(AllocatorTest, MarksLongListsWithoutRecursion)
+{
+    Allocator allocator;
+    Context ctx;
+    ctx.allocator = &allocator;
+
+    Value list = Value::Nil;
+    for (int i = 0; i < 1000000; ++i)
+        list = Value::fromPointer(allocator.makeTenured<PairObject>(Value::fromInteger(1), list));
+    ctx.value_stack.push_back(list);
+    allocator.gc(&ctx);
+
+    EXPECT_EQ(1000000, sumList(ctx.value_stack.back()));
+}
+
+namespace {
+
+void checkSnapshot(Allocator& allocator)
+{
+    Context ctx;
+    ctx.allocator = &allocator;
+    allocator.setInitialLimit(1024);
+
+    PairObject* moved = allocator.makeTenured<PairObject>(Value::fromInteger(42), Value::Nil);
+    PairObject* tail = allocator.makeTenured<PairObject>(Value::fromPointer(moved), Value::Nil);
+    Value list = Value::fromPointer(tail);
+    for (int i = 0; i < 100000; ++i)
+        list = Value::fromPointer(allocator.makeTenured<PairObject>(Value::fromInteger(0), list));
+    PairObject* holder = allocator.makeTenured<PairObject>(Value::Nil, Value::Nil);
+    ctx.value_stack.push_back(list);
+    ctx.value_stack.push_back(Value::fromPointer(holder));
+
+    allocator.gc(&ctx);
+    holder->setCar(tail->getCar());
+    tail->setCar(Value::Nil);
+    while (allocator.isMarking()) {
+        std::this_thread::yield();
+        allocator.gc(&ctx);
+    }
+    for (int i = 0; i < 200000; ++i)
+        allocator.makeTenured<PairObject>(Value::fromInteger(-1), Value::Nil);
+
+    PairObject* p = static_cast<PairObject*>(holder->getCar().asPointer());
+    EXPECT_EQ(42, p->getCar().asInteger());
+}
+
+} // namespace
+
+TEST(AllocatorTest, IncrementalMarkingKeepsSnapshot)
+{
+    Allocator allocator;
+    allocator.setPauseBudget(std::chrono::microseconds(1));
+    checkSnapshot(allocator);
+}
+
+TEST(AllocatorTest, ConcurrentMarkingKeepsSnapshot)
+{
+    Allocator allocator;
+    allocator.setConcurrent(true);
+    checkSnapshot(allocator);
+}
+
+TEST(AllocatorTest, FinishesConcurrentMarkingWhileOverwriting)
+{
+    Allocator allocator;
+    allocator.setConcurrent(true);
+    allocator.setInitialLimit(1024);
+    GcStats stats;
+    allocator.setStats(&stats);
+    Context ctx;
+    ctx.allocator = &allocator;
+
+    std::vector<PairObject*> slots;
+    Value list = Value::Nil;
+    for (int i = 0; i < 20000; ++i) {
+        PairObject* car = allocator.makeTenured<PairObject>(Value::Nil, Value::Nil);
+        slots.push_back(allocator.makeTenured<PairObject>(Value::fromPointer(car), list));
+        list = Value::fromPointer(slots.back());
+    }
+    ctx.value_stack.push_back(list);
+    allocator.gc(&ctx);
+    ASSERT_TRUE(allocator.isMarking());
+    size_t start_size = stats.getEvents().back().heap_size;
+
+    // 古いスロットを書き換え続けても、マークスレッドが追いつけばサイクルは終わる
+    for (size_t i = 0; allocator.isMarking(); ++i) {
+        for (size_t j = 0; j < 100; ++j) {
+            PairObject* car = allocator.makeTenured<PairObject>(Value::Nil, Value::Nil);
+            slots[(i * 100 + j) % slots.size()]->setCar(Value::fromPointer(car));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        allocator.gc(&ctx);
+    }
+    const std::vector<GcEvent>& events = stats.getEvents();
+    EXPECT_TRUE(events.back().major);
+    EXPECT_LT(events[events.size() - 2].heap_size, start_size * 3 / 2);
+}
+
+TEST(AllocatorTest, ParallelMarkingKeepsReachableObjects)
+{
+    Allocator allocator;
+    allocator.setThreads(4);
+    Context ctx;
+    ctx.allocator = &allocator;
+
+    for (int n = 0; n < 8; ++n) {
+        Value list = Value::Nil;
+        for (int i = 0; i < 100000; ++i) {
+            list = Value::fromPointer(
+                allocator.makeTenured<PairObject>(Value::fromInteger(1), list));
+            allocator.makeTenured<PairObject>(Value::fromInteger(-1), Value::Nil); // garbage
+        }
+        ctx.value_stack.push_back(list);
+    }
+    allocator.gc(&ctx);
+    for (int i = 0; i < 1000000; ++i)
+        allocator.makeTenured<PairObject>(Value::fromInteger(-1), Value::Nil);
+
+    for (Value list : ctx.value_stack)
+        EXPECT_EQ(100000, sumList(list));
+}
+
+TEST(AllocatorTest, CapsMarkingThreads)
+{
+    Allocator allocator;
+    allocator.setInitialLimit(1024);
+    allocator.setThreads(static_cast<size_t>(-1));
+    Context ctx;
+    ctx.allocator = &allocator;
+
+    Value list = Value::Nil;
+    for (int i = 0; i < 1000; ++i) {
+        list = Value::fromPointer(allocator.makeTenured<PairObject>(Value::fromInteger(1), list));
+        allocator.makeTenured<PairObject>(Value::fromInteger(-1), Value::Nil); // garbage
+    }
+    ctx.value_stack.push_back(list);
+    allocator.gc(&ctx);
+    EXPECT_EQ(1000, sumList(ctx.value_stack.back()));
+}
+
+TEST(AllocatorTest, ReusesWorkerThreads)
+{
+    WorkerPool pool;
+    pool.setThreads(4);
+    std::mutex mutex;
+    std::set<std::thread::id> first;
+    std::set<std::thread::id> ids;
+
+    // 何度仕事を渡しても、同じスレッドがそれぞれの番号を一度ずつ受け持つ
+    for (int round = 0; round < 100; ++round) {
+        std::vector<int> counts(4, 0);
+        ids.clear();
+        pool.run(4, [&](size_t id) {
+            counts[id]++;
+            std::lock_guard<std::mutex> lock(mutex);
+            ids.insert(std::this_thread::get_id());
+        });
+        EXPECT_EQ(std::vector<int>(4, 1), counts);
+        if (round == 0)
+            first = ids;
+        EXPECT_EQ(first, ids);
+    }
+    EXPECT_EQ(4u, first.size());
+
+    // 少ない数を頼めば、残りのスレッドは待ったままになる
+    int n_calls = 0;
+    pool.run(1, [&](size_t) { n_calls++; });
+    EXPECT_EQ(1, n_calls);
+}
+
+TEST(AllocatorTest, SweepsLazilyWhileAllocating)
+{
+    Allocator allocator;
+    allocator.setInitialLimit(1024);
+    Context ctx;
+    ctx.allocator = &allocator;
+
+    for (int n = 0; n < 3; ++n) {
+        // 前のサイクルで死んだセルを sweep しながら割り当てる
+        Value list = Value::Nil;
+        for (int i = 0; i < 100000; ++i) {
+            list = Value::fromPointer(
+                allocator.makeTenured<PairObject>(Value::fromInteger(1), list));
+            allocator.makeTenured<PairObject>(Value::fromInteger(-1), Value::Nil); // garbage
+        }
+        ctx.value_stack.push_back(list);
+        allocator.gc(&ctx);
+    }
+
+    for (Value list : ctx.value_stack)
+        EXPECT_EQ(100000, sumList(list));
+}
+
+TEST(AllocatorTest, CompactsSparsePages)
+{
+    Allocator allocator;
+    Context ctx;
+    ctx.allocator = &allocator;
+
+    // 生きているペアを古い世代のページにまばらに散らばらせる
+    Value list = Value::Nil;
+    for (int i = 0; i < 100000; ++i) {
+        list = Value::fromPointer(allocator.makeTenured<PairObject>(Value::fromInteger(i), list));
+        for (int j = 0; j < 9; ++j)
+            allocator.makeTenured<PairObject>(Value::fromInteger(-1), Value::Nil); // garbage
+    }
+    ctx.value_stack.push_back(list);
+    PairObject* literal = allocator.makeTenured<PairObject>(Value::fromInteger(7), Value::Nil);
+    ctx.literals.push_back(Value::fromPointer(literal));
+    EXPECT_LT(200u, countPages(list));
+    allocator.compact(&ctx);
+
+    EXPECT_GT(30u, countPages(ctx.value_stack.back()));
+    EXPECT_EQ(int64_t(100000) * 99999 / 2, sumList(ctx.value_stack.back()));
+    EXPECT_EQ(Value::fromPointer(literal), ctx.literals.back());
+    EXPECT_EQ(7, literal->getCar().asInteger());
+}
+
+TEST(AllocatorTest, WaitsForLiveSizeTimesGrowthFactor)
+{
+    Allocator allocator;
+    allocator.setInitialLimit(1024);
+    allocator.setGrowthFactor(3);
+    Context ctx;
+    ctx.allocator = &allocator;
+
+    Value list = Value::Nil;
+    for (int i = 0; i < 100000; ++i)
+        list = Value::fromPointer(allocator.makeTenured<PairObject>(Value::fromInteger(1), list));
+    ctx.value_stack.push_back(list);
+    allocator.gc(&ctx);
+    EXPECT_FALSE(allocator.needGc());
+
+    // 生き残りの 2 倍までは割り当てても回収しない
+    for (int i = 0; i < 199000; ++i)
+        allocator.makeTenured<PairObject>(Value::fromInteger(-1), Value::Nil);
+    EXPECT_FALSE(allocator.needGc());
+    for (int i = 0; i < 2000; ++i)
+        allocator.makeTenured<PairObject>(Value::fromInteger(-1), Value::Nil);
+    EXPECT_TRUE(allocator.needGc());
+}
+
+TEST(AllocatorTest, RecordsEachCollection)
+{
+    Allocator allocator;
+    allocator.setInitialLimit(1024);
+    GcStats stats;
+    allocator.setStats(&stats);
+    Context ctx;
+    ctx.allocator = &allocator;
+
+    ctx.value_stack.push_back(Value::fromPointer(
+        allocator.make<PairObject>(Value::fromInteger(1), Value::Nil)));
+    for (int i = 0; i < 1000; ++i)
+        allocator.makeTenured<PairObject>(Value::fromInteger(-1), Value::Nil); // garbage
+    allocator.gc(&ctx);
+    allocator.gc(&ctx);
+
+    ASSERT_EQ(2u, stats.getEvents().size());
+    const GcEvent& first = stats.getEvents()[0];
+    EXPECT_TRUE(first.major);
+    EXPECT_EQ(sizeof(PairObject), first.promoted_bytes);
+    EXPECT_EQ(1u, first.marked_objects);
+    EXPECT_EQ(sizeof(PairObject), first.heap_size);
+    EXPECT_EQ(1024u, first.limit);
+    // 死んだセルは次の割り当てか次のサイクルまで解放されない
+    EXPECT_EQ(0u, first.freed_objects);
+    EXPECT_GE(stats.getPausePercentile(100), stats.getPausePercentile(50));
+}
+
+TEST(AllocatorTest, CountsOutOfLineStorage)
+{
+    Allocator allocator;
+    allocator.makeTenured<VectorObject>(1024 * 1024, Value::Nil);
+    EXPECT_TRUE(allocator.needGc());
+
+    Allocator young_allocator;
+    young_allocator.make<VectorObject>(256 * 1024, Value::Nil);
+    EXPECT_TRUE(young_allocator.needGc());
+}
+
+TEST(AllocatorTest, KeepsOutOfLineSizeOfWeakObjectsUpToDate)
+{
+    // 並行マークのスレッドが読む大きさは、中身を変えるたびに更新される
+    Allocator allocator;
+    auto table = allocator.makeTenured<WeakTableObject>();
+    size_t empty_size = table->getExternalSize();
+    for (int i = 0; i < 100; ++i)
+        table->set(Value::fromInteger(i), Value::Nil);
+    EXPECT_GE(table->getExternalSize(), empty_size + 100 * sizeof(std::pair<Value, Value>));
+
+    auto guardian = allocator.makeTenured<GuardianObject>();
+    EXPECT_EQ(0u, guardian->getExternalSize());
+    guardian->add(Value::fromInteger(1));
+    EXPECT_GE(guardian->getExternalSize(), sizeof(Value));
+}
+
+TEST(AllocatorTest, UpdatesLocalRoots)
+{
+    Allocator allocator;
+    Context ctx;
+    ctx.allocator = &allocator;
+
+    Value v = Value::fromPointer(allocator.make<PairObject>(Value::fromInteger(5), Value::Nil));
+    Value before = v;
+    {
+        LocalRoot root(&ctx, &v);
+        allocator.gc(&ctx);
+    }
+    EXPECT_TRUE(ctx.local_roots.empty());
+    EXPECT_NE(before, v);
+    EXPECT_EQ(5, static_cast<PairObject*>(v.asPointer())->getCar().asInteger());
+}
+
+TEST(AllocatorTest, ClearsWeakReferencesToDeadObjects)
+{
+    Allocator allocator;
+    Context ctx;
+    ctx.allocator = &allocator;
+
+    Value key = Value::fromPointer(allocator.make<PairObject>(Value::fromInteger(1), Value::Nil));
+    Value dead_key = Value::fromPointer(allocator.make<PairObject>(Value::Nil, Value::Nil));
+    Value value = Value::fromPointer(allocator.make<PairObject>(Value::fromInteger(2), Value::Nil));
+    auto box = allocator.make<WeakBoxObject>(dead_key);
+    auto ephemeron = allocator.make<EphemeronObject>(key, value);
+    auto table = allocator.make<WeakTableObject>();
+    table->set(key, Value::fromInteger(3));
+    table->set(dead_key, value);
+    ctx.value_stack.push_back(key);
+    ctx.value_stack.push_back(Value::fromPointer(box));
+    ctx.value_stack.push_back(Value::fromPointer(ephemeron));
+    ctx.value_stack.push_back(Value::fromPointer(table));
+
+    // 若い世代の回収ではキーが生きている ephemeron の値だけが残る
+    allocator.gc(&ctx);
+    key = ctx.value_stack[0];
+    box = static_cast<WeakBoxObject*>(ctx.value_stack[1].asPointer());
+    ephemeron = static_cast<EphemeronObject*>(ctx.value_stack[2].asPointer());
+    table = static_cast<WeakTableObject*>(ctx.value_stack[3].asPointer());
+    EXPECT_EQ(Value::False, box->getValue());
+    EXPECT_EQ(key, ephemeron->getKey());
+    EXPECT_EQ(2, static_cast<PairObject*>(ephemeron->getValue().asPointer())->getCar().asInteger());
+    EXPECT_EQ(1u, table->getSize());
+    EXPECT_EQ(3, table->get(key, Value::Nil).asInteger());
+
+    // 古い世代でもキーが死ねば消える
+    ctx.value_stack[0] = Value::Nil;
+    allocator.compact(&ctx);
+    ephemeron = static_cast<EphemeronObject*>(ctx.value_stack[2].asPointer());
+    table = static_cast<WeakTableObject*>(ctx.value_stack[3].asPointer());
+    EXPECT_EQ(Value::False, ephemeron->getKey());
+    EXPECT_EQ(Value::False, ephemeron->getValue());
+    EXPECT_EQ(0u, table->getSize());
+}
+
+TEST(AllocatorTest, ClearsYoungKeysInOldWeakTables)
+{
+    Allocator allocator;
+    Context ctx;
+    ctx.allocator = &allocator;
+
+    auto table = allocator.make<WeakTableObject>();
+    ctx.value_stack.push_back(Value::fromPointer(table));
+    for (int i = 0; i < 1000; ++i) {
+        Value key = Value::fromPointer(allocator.makeTenured<PairObject>(Value::Nil, Value::Nil));
+        ctx.value_stack.push_back(key);
+        table->set(key, Value::fromInteger(i));
+    }
+    allocator.gc(&ctx);
+    table = static_cast<WeakTableObject*>(ctx.value_stack[0].asPointer());
+    ASSERT_FALSE(Page::of(table)->isYoung());
+
+    // 値が即値でも、若いキーを入れた古い表は若い世代の回収で調べる
+    Value key = Value::fromPointer(allocator.make<PairObject>(Value::Nil, Value::Nil));
+    Value dead_key = Value::fromPointer(allocator.make<PairObject>(Value::Nil, Value::Nil));
+    table->set(key, Value::fromInteger(-1));
+    table->set(dead_key, Value::fromInteger(-2));
+    ctx.value_stack.push_back(key);
+    allocator.gc(&ctx);
+    key = ctx.value_stack.back();
+    EXPECT_FALSE(Page::of(key.asPointer())->isYoung());
+    EXPECT_EQ(1001u, table->getSize());
+    EXPECT_EQ(-1, table->get(key, Value::Nil).asInteger());
+    EXPECT_EQ(999, table->get(ctx.value_stack[1000], Value::Nil).asInteger());
+}
+
+TEST(AllocatorTest, QueuesUnreachableGuardedObjects)
+{
+    Allocator allocator;
+    Context ctx;
+    ctx.allocator = &allocator;
+
+    auto guardian = allocator.make<GuardianObject>();
+    Value young = Value::fromPointer(allocator.make<PairObject>(Value::fromInteger(1), Value::Nil));
+    Value old = Value::fromPointer(allocator.makeTenured<PairObject>(young, Value::Nil));
+    Value kept = Value::fromPointer(allocator.make<PairObject>(Value::fromInteger(2), Value::Nil));
+    guardian->add(old);
+    guardian->add(kept);
+    ctx.value_stack.push_back(Value::fromPointer(guardian));
+    ctx.value_stack.push_back(kept);
+    ctx.value_stack.push_back(old);
+
+    allocator.gc(&ctx);
+    guardian = static_cast<GuardianObject*>(ctx.value_stack[0].asPointer());
+    EXPECT_EQ(Value::False, guardian->next());
+
+    // 取り出し待ちになったオブジェクトから指されているものも回収されない
+    ctx.value_stack.pop_back();
+    allocator.compact(&ctx);
+    guardian = static_cast<GuardianObject*>(ctx.value_stack[0].asPointer());
+    Value ready = guardian->next();
+    ASSERT_TRUE(ready.isPointer());
+    EXPECT_EQ(1, sumList(static_cast<PairObject*>(ready.asPointer())->getCar()));
+    EXPECT_EQ(Value::False, guardian->next());
+}
+
+TEST(AllocatorTest, DumpsReachableObjectsWithRetainers)
+{
+    Allocator allocator;
+    Context ctx;
+    ctx.allocator = &allocator;
+
+    Value inner = Value::fromPointer(allocator.make<PairObject>(Value::fromInteger(1), Value::Nil));
+    allocator.make<PairObject>(Value::Nil, Value::Nil); // garbage
+    ctx.value_stack.push_back(Value::fromPointer(allocator.make<PairObject>(inner, Value::Nil)));
+
+    FILE* out = std::tmpfile();
+    writeHeapDump(&ctx, out);
+    std::rewind(out);
+    std::string json;
+    for (int ch; (ch = std::fgetc(out)) != EOF;)
+        json.push_back(static_cast<char>(ch));
+    std::fclose(out);
+
+    EXPECT_NE(std::string::npos,
+              json.find("{\"type\": \"PairObject\", \"count\": 2, \"bytes\": 32}"));
+    EXPECT_NE(std::string::npos,
+              json.find("{\"kind\": \"value_stack\", \"name\": \"0\", \"object\": 0}"));
+    EXPECT_NE(std::string::npos,
+              json.find("{\"id\": 1, \"type\": \"PairObject\", \"bytes\": 16, \"retainer\": 0"));
+}
+
+TEST(AllocatorTest, MapsLargeArraysDirectly)
+{
+    void* memory = mapLargeSpace(3 * Page::kSize, Page::kSize);
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(memory) % Page::kSize);
+    static_cast<char*>(memory)[3 * Page::kSize - 1] = 1;
+    unmapLargeSpace(memory, 3 * Page::kSize);
+
+    Allocator allocator;
+    Context ctx;
+    ctx.allocator = &allocator;
+    auto vector = allocator.make<VectorObject>(100000, Value::fromInteger(1));
+    ctx.value_stack.push_back(Value::fromPointer(vector));
+    allocator.gc(&ctx);
+
+    vector = static_cast<VectorObject*>(ctx.value_stack.back().asPointer());
+    int64_t sum = 0;
+    for (size_t i = 0; i < vector->getLength(); ++i)
+        sum += vector->get(i).asInteger();
+    EXPECT_EQ(100000, sum);
+}
+
+TEST(AllocatorTest, KeepsPairsWithoutHeaders)
+{
+    EXPECT_EQ(16u, sizeof(PairObject));
+
+    Allocator allocator;
+    Context ctx;
+    ctx.allocator = &allocator;
+    Value list = Value::Nil;
+    for (int i = 0; i < 100000; ++i) {
+        list = Value::fromPointer(allocator.make<PairObject>(Value::fromInteger(1), list));
+        ctx.value_stack.push_back(list);
+        allocator.safepoint(&ctx);
+        list = ctx.value_stack.back();
+        ctx.value_stack.pop_back();
+    }
+    ctx.value_stack.push_back(list);
+    ctx.value_stack.push_back(Value::fromPointer(allocator.make<StringObject>("pair")));
+    allocator.gc(&ctx);
+
+    // 生き残ったペアは古い世代のペア専用のページに隙間なく並ぶ
+    list = ctx.value_stack[0];
+    Object* pair = list.asPointer();
+    EXPECT_EQ(ObjectType::kPair, pair->getType());
+    EXPECT_TRUE(Page::of(pair)->holdsPairs());
+    EXPECT_FALSE(Page::of(pair)->isYoung());
+    EXPECT_GT(30u, countPages(list));
+    EXPECT_EQ(100000, sumList(list));
+    Object* string = ctx.value_stack[1].asPointer();
+    EXPECT_EQ(ObjectType::kString, string->getType());
+    EXPECT_FALSE(Page::of(string)->holdsPairs());
+}
+
+TEST(AllocatorTest, FreesInBackground)
+{
+    Allocator allocator;
+    allocator.setInitialLimit(1024);
+    allocator.setBackgroundFree(true);
+    Context ctx;
+    ctx.allocator = &allocator;
+
+    for (int i = 0; i < 100; ++i) {
+        ctx.value_stack.push_back(
+            Value::fromPointer(allocator.make<VectorObject>(10000, Value::fromInteger(i))));
+        for (int j = 0; j < 1000; ++j)
+            allocator.make<PairObject>(Value::fromInteger(j), Value::Nil); // garbage
+        allocator.gc(&ctx);
+        if (i % 2 == 0)
+            ctx.value_stack.pop_back(); // 次の gc() でスレッドに渡される
+    }
+    allocator.compact(&ctx);
+
+    ASSERT_EQ(50u, ctx.value_stack.size());
+    for (size_t i = 0; i < ctx.value_stack.size(); ++i) {
+        auto vector = static_cast<VectorObject*>(ctx.value_stack[i].asPointer());
+        EXPECT_EQ(10000u, vector->getLength());
+        EXPECT_EQ(int64_t(i * 2 + 1), vector->get(9999).asInteger());
+    }
+}
+
+TEST(AllocatorTest, ReturnsFreedPagesToTheOs)
+{
+    Allocator allocator;
+    allocator.setInitialLimit(1024);
+    allocator.setGrowthFactor(1.1);
+    GcStats stats;
+    allocator.setStats(&stats);
+    Context ctx;
+    ctx.allocator = &allocator;
+
+    Value list = Value::Nil;
+    for (int i = 0; i < 1000000; ++i)
+        list = Value::fromPointer(allocator.makeTenured<PairObject>(Value::fromInteger(1), list));
+    ctx.value_stack.push_back(list);
+    allocator.gc(&ctx);
+    size_t peak = stats.getEvents().back().committed_bytes;
+    EXPECT_LT(size_t(1000000) * sizeof(PairObject), peak);
+
+    // 一時的に膨らんだ分を捨てて、次の回収でページを OS に返させる
+    ctx.value_stack.clear();
+    for (int i = 0; i < 200000; ++i)
+        allocator.makeTenured<PairObject>(Value::fromInteger(-1), Value::Nil); // garbage
+    allocator.gc(&ctx);
+    EXPECT_TRUE(stats.getEvents().back().major);
+    EXPECT_GT(peak / 4, stats.getEvents().back().committed_bytes);
+}
+
+TEST(AllocatorTest, KeepsHugePagesWhole)
+{
+    PageSpace space;
+    space.setHugePages(true);
+    void* first = space.allocatePage();
+    void* second = space.allocatePage();
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(first) % PageSpace::kRegionSize);
+    static_cast<char*>(first)[0] = 1;
+    static_cast<char*>(second)[0] = 1;
+
+    // 空いたページがあっても、領域を丸ごと返せるまでは huge page を分割しない
+    space.freePage(second);
+    space.trim();
+    EXPECT_EQ(size_t(PageSpace::kRegionSize), space.getCommittedSize());
+    space.freePage(first);
+    space.trim();
+    EXPECT_EQ(0u, space.getCommittedSize());
+}
+
+TEST(AllocatorTest, CompressesFrameReferences)
+{
+#ifdef NSCHEME_COMPRESSED_REFS
+    EXPECT_EQ(32u, sizeof(Frame));
+    EXPECT_EQ(32u, sizeof(ClosureObject));
+#endif
+
+    Allocator allocator;
+    Context ctx;
+    ctx.allocator = &allocator;
+    ctx.frame_stack.push_back(nullptr);
+    for (int i = 0; i < 100000; ++i) {
+        Frame* parent = ctx.frame_stack.back();
+        ctx.frame_stack.back()
+            = allocator.make<Frame>(parent, std::vector<Value>(1, Value::fromInteger(i)));
+        allocator.safepoint(&ctx);
+    }
+    ctx.value_stack.push_back(Value::fromPointer(
+        allocator.make<ClosureObject>(nullptr, ctx.frame_stack.back(), 0, 0)));
+    ctx.frame_stack.clear();
+    allocator.compact(&ctx);
+
+    // 移動した後も親をたどれる
+    auto closure = static_cast<ClosureObject*>(ctx.value_stack.back().asPointer());
+    int64_t sum = 0;
+    for (Frame* f = closure->getFrame(); f != nullptr; f = f->getParent()) {
+        if (!f->getVariables().empty())
+            sum += f->getVariables()[0].asInteger();
+    }
+    EXPECT_EQ(int64_t(100000) * 99999 / 2, sum);
+}
+
+TEST(AllocatorTest, KeepsImmortalObjectsWithoutTracing)
+{
+    Allocator allocator;
+    allocator.setInitialLimit(1024);
+    GcStats stats;
+    allocator.setStats(&stats);
+    Context ctx;
+    ctx.allocator = &allocator;
+
+    // 根から指されていなくても回収されず、マークもされない
+    PairObject* list = nullptr;
+    for (int i = 0; i < 10000; ++i) {
+        Value cdr = list == nullptr ? Value::Nil : Value::fromPointer(list);
+        list = allocator.makeImmortal<PairObject>(Value::fromInteger(1), cdr);
+    }
+    EXPECT_TRUE(Page::of(list)->isImmortal());
+    ctx.value_stack.push_back(Value::fromPointer(list));
+    ctx.value_stack.push_back(
+        Value::fromPointer(allocator.makeTenured<PairObject>(Value::Nil, Value::Nil)));
+    for (int i = 0; i < 1000; ++i)
+        allocator.makeTenured<PairObject>(Value::Nil, Value::Nil); // garbage
+    allocator.gc(&ctx);
+    EXPECT_TRUE(stats.getEvents().back().major);
+    EXPECT_EQ(1u, stats.getEvents().back().marked_objects);
+    ctx.value_stack.clear();
+
+    // 書き換えで指すようになった若いオブジェクトは生き残る
+    PairObject* young = allocator.make<PairObject>(Value::fromInteger(2), Value::Nil);
+    list->setCar(Value::fromPointer(young));
+    allocator.compact(&ctx);
+    allocator.gc(&ctx);
+
+    auto car = static_cast<PairObject*>(list->getCar().asPointer());
+    EXPECT_FALSE(Page::of(car)->isYoung());
+    EXPECT_EQ(2, car->getCar().asInteger());
+    EXPECT_EQ(9999, sumList(list->getCdr()));
+}
+
+TEST(AllocatorTest, DropsRegionAtOnce)
+{
+    Allocator allocator;
+    allocator.setInitialLimit(1024);
+    Context ctx;
+    ctx.allocator = &allocator;
+    PairObject* persistent = allocator.make<PairObject>(Value::fromInteger(0), Value::Nil);
+
+    allocator.beginRegion();
+    PairObject* list = allocator.make<PairObject>(Value::fromInteger(1), Value::Nil);
+    Page* region_page = Page::of(list);
+    EXPECT_TRUE(region_page->isRegion());
+    for (int i = 1; i < 10000; ++i) {
+        list = allocator.make<PairObject>(Value::fromInteger(1), Value::fromPointer(list));
+        allocator.make<StringObject>(std::string(100, 'x')); // garbage
+    }
+    EXPECT_FALSE(allocator.needGc());
+
+    // リージョンの外にはリージョンのオブジェクトを書き込めず、移したものだけが残る
+    EXPECT_THROW(persistent->setCdr(Value::fromPointer(list)), std::runtime_error);
+    StringObject* str = allocator.make<StringObject>("kept");
+    Value kept = allocator.promote(Value::fromPointer(
+        allocator.make<PairObject>(Value::fromPointer(str), Value::fromPointer(list))));
+    allocator.endRegion(&ctx);
+    persistent->setCdr(kept);
+
+    // 次のリージョンは同じページを先頭から使い回す
+    allocator.beginRegion();
+    EXPECT_EQ(region_page, Page::of(allocator.make<PairObject>(Value::Nil, Value::Nil)));
+    allocator.endRegion(&ctx);
+
+    ctx.value_stack.push_back(Value::fromPointer(persistent));
+    allocator.compact(&ctx);
+    auto head = static_cast<PairObject*>(
+        static_cast<PairObject*>(ctx.value_stack.back().asPointer())->getCdr().asPointer());
+    EXPECT_FALSE(Page::of(head)->isRegion());
+    EXPECT_EQ("kept", static_cast<StringObject*>(head->getCar().asPointer())->getString());
+    EXPECT_EQ(10000, sumList(head->getCdr()));
+}
+
+TEST(AllocatorTest, KeepsRegionWhileRootsReferToIt)
+{
+    Allocator allocator;
+    SymbolTable symbol_table;
+    Context ctx;
+    ctx.allocator = &allocator;
+    Symbol name = symbol_table.intern("x");
+
+    // 大域変数に残っている間は捨てずに例外を投げる
+    allocator.beginRegion();
+    PairObject* pair = allocator.make<PairObject>(Value::fromInteger(1), Value::Nil);
+    ctx.named_variables.insert(std::make_pair(name, Value::fromPointer(pair)));
+    EXPECT_THROW(allocator.endRegion(&ctx), std::runtime_error);
+    EXPECT_TRUE(allocator.isInRegion());
+    EXPECT_EQ(1, pair->getCar().asInteger());
+
+    Value& x = ctx.named_variables.at(name);
+    x = allocator.promote(x);
+    allocator.endRegion(&ctx);
+    EXPECT_FALSE(allocator.isInRegion());
+    auto kept = static_cast<PairObject*>(x.asPointer());
+    EXPECT_FALSE(Page::of(kept)->isRegion());
+    EXPECT_EQ(1, kept->getCar().asInteger());
+}
+
+TEST(AllocatorTest, RefusesToGuardRegionObjectsFromOutside)
+{
+    Allocator allocator;
+    Context ctx;
+    ctx.allocator = &allocator;
+    auto guardian = allocator.make<GuardianObject>();
+    ctx.value_stack.push_back(Value::fromPointer(guardian));
+
+    // リージョンの外のガーディアンにはリージョンのオブジェクトを登録できない
+    allocator.beginRegion();
+    Value pair = Value::fromPointer(allocator.make<PairObject>(Value::fromInteger(1), Value::Nil));
+    EXPECT_THROW(guardian->add(pair), std::runtime_error);
+    guardian->add(allocator.promote(pair));
+    allocator.endRegion(&ctx);
+
+    allocator.compact(&ctx);
+    guardian = static_cast<GuardianObject*>(ctx.value_stack[0].asPointer());
+    Value ready = guardian->next();
+    ASSERT_TRUE(ready.isPointer());
+    EXPECT_EQ(1, sumList(ready));
+    EXPECT_EQ(Value::False, guardian->next());
+}
+
+TEST(AllocatorTest, CopiesListsCdrFirst)
+{
+    Allocator allocator;
+    Context ctx;
+    ctx.allocator = &allocator;
+
+    // 要素もペアなので、割り当てた順では背骨と要素のセルが交互に並んでいる
+    ctx.value_stack.push_back(Value::Nil);
+    for (int i = 0; i < 1000; ++i) {
+        PairObject* entry = allocator.make<PairObject>(Value::fromInteger(i), Value::Nil);
+        ctx.value_stack.back() = Value::fromPointer(
+            allocator.make<PairObject>(Value::fromPointer(entry), ctx.value_stack.back()));
+    }
+    allocator.gc(&ctx);
+
+    size_t n_adjacent = 0;
+    PairObject* pair = static_cast<PairObject*>(ctx.value_stack.back().asPointer());
+    EXPECT_FALSE(Page::of(pair)->isYoung());
+    while (pair->getCdr().isPointer()) {
+        PairObject* next = static_cast<PairObject*>(pair->getCdr().asPointer());
+        if (next == pair + 1)
+            n_adjacent++;
+        pair = next;
+    }
+    EXPECT_EQ(999u, n_adjacent);
+}